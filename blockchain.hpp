@@ -3,40 +3,338 @@
 #define __blockchain__blockchain_hpp
 
 #include "helpers.hpp"
+#include "hex.hpp"
 
 #include "picosha2.h"
 
 #include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
 #include <ostream>
+#include <string>
 
 /*************************************************************************************************/
 
-struct block {
+// 'Payload' is std::string for the variable size chains, or std::array<char, N>
+// for the chains whose every payload is exactly N bytes (see layout.hpp).
+template<typename Payload>
+struct basic_block {
     std::uint64_t idx;
     std::uint64_t timestamp;
     std::string prevsha256;
-    std::string data;
+    Payload data;
     std::string sha256;
+    // the payload was dropped by storage::prune(), 'sha256' still holds its digest.
+    bool pruned{};
 };
 
+using block = basic_block<std::string>;
+
+inline const char* payload_data(const std::string &p) { return p.data(); }
+inline std::size_t payload_size(const std::string &p) { return p.size(); }
+
+template<std::size_t N>
+const char* payload_data(const std::array<char, N> &p) { return p.data(); }
+template<std::size_t N>
+std::size_t payload_size(const std::array<char, N> &) { return N; }
+
+inline
+void assign_payload(std::string *p, const char *data, std::size_t size) {
+    p->assign(data, size);
+}
+// a shorter payload is zero padded, a longer one is cut.
+template<std::size_t N>
+void assign_payload(std::array<char, N> *p, const char *data, std::size_t size) {
+    size = std::min(size, N);
+    std::memcpy(p->data(), data, size);
+    std::memset(p->data() + size, 0, N - size);
+}
+
 /*************************************************************************************************/
 
+// the binary form of a sha256 hex string. the lookups decode their key once
+// and compare the four words instead of the 64 chars.
+struct digest {
+    std::uint64_t w[4];
+
+    friend bool operator== (const digest &l, const digest &r) {
+        return ((l.w[0] ^ r.w[0]) | (l.w[1] ^ r.w[1]) | (l.w[2] ^ r.w[2]) | (l.w[3] ^ r.w[3])) == 0;
+    }
+    friend bool operator!= (const digest &l, const digest &r) {
+        return !(l == r);
+    }
+};
+
+// the digest is uniformly distributed already.
+struct digest_hasher {
+    std::size_t operator()(const digest &d) const { return d.w[0]; }
+};
+
+// accepts both lower and upper case.
+inline
+bool parse_digest(digest *d, const char *hex, std::size_t len) {
+    if ( len != sizeof(d->w)*2 ) {
+        return false;
+    }
+
+    return hex_decode(hex, sizeof(d->w), reinterpret_cast<std::uint8_t *>(d->w));
+}
+
 inline
-block new_block(const std::string &prevsha256, std::uint64_t nblocks, const char *data, std::size_t size) {
-    block b;
+bool parse_digest(digest *d, const std::string &hex) {
+    return parse_digest(d, hex.data(), hex.size());
+}
+
+inline
+std::string sha256_hex(const char *data, std::size_t size) {
+    std::uint8_t hash[picosha2::k_digest_size];
+    picosha2::hash256(data, data + size, hash, hash + sizeof(hash));
+
+    return hex_encode(hash, sizeof(hash));
+}
+
+inline
+std::string sha256_hex(const std::string &data) {
+    return sha256_hex(data.data(), data.size());
+}
+
+template<std::size_t N>
+std::string sha256_hex(const std::array<char, N> &data) {
+    return sha256_hex(data.data(), N);
+}
+
+// the digest of a chain extended by the block 'hash': the sha256 of the digest
+// of the chain below it followed by the block hash. the digest below the root is all zeros.
+inline
+digest chain_step(const digest &below, const digest &hash) {
+    std::uint8_t buf[sizeof(digest)*2];
+    std::memcpy(buf, below.w, sizeof(digest));
+    std::memcpy(buf + sizeof(digest), hash.w, sizeof(digest));
+
+    digest d{};
+    std::uint8_t *out = reinterpret_cast<std::uint8_t *>(d.w);
+    picosha2::hash256(buf, buf + sizeof(buf), out, out + sizeof(digest));
+
+    return d;
+}
+
+/*************************************************************************************************/
+
+template<typename Payload = std::string>
+basic_block<Payload> new_block(const std::string &prevsha256, std::uint64_t nblocks, const char *data, std::size_t size) {
+    basic_block<Payload> b;
     b.idx = nblocks;
     b.timestamp = timestamp();
     b.prevsha256 = prevsha256;
-    b.data.assign(data, size);
-    b.sha256 = picosha2::hash256_hex_string(b.data.begin(), b.data.end());
+    assign_payload(&b.data, data, size);
+    b.sha256 = sha256_hex(b.data);
 
     return b;
 }
 
 /*************************************************************************************************/
 
+// the record layout used both in the file and on the wire:
+// idx, timestamp, then prevsha256, data and sha256 each prefixed by its uint32_t length.
+// a pruned payload is written as the length 'pruned_payload_size' with no bytes following.
+// in the file the record is also followed by its length, see variable_layout.
+enum: std::uint32_t { pruned_payload_size = 0xffffffffu };
+
+inline
+void encode_string(std::string &buf, const std::string &s) {
+    std::uint32_t size = s.size();
+    buf.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    buf.append(s);
+}
+
 inline
-std::ostream& dump(std::ostream &os, const block &b) {
+void encode_block(std::string &buf, const block &b) {
+    buf.append(reinterpret_cast<const char *>(&b.idx), sizeof(b.idx));
+    buf.append(reinterpret_cast<const char *>(&b.timestamp), sizeof(b.timestamp));
+    encode_string(buf, b.prevsha256);
+    if ( b.pruned ) {
+        std::uint32_t size = pruned_payload_size;
+        buf.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    } else {
+        encode_string(buf, b.data);
+    }
+    encode_string(buf, b.sha256);
+}
+
+/*************************************************************************************************/
+
+enum class decode_error {
+     ok
+    ,truncated
+    ,bad_prev_hash
+    ,bad_hash
+    ,bad_footer
+};
+
+inline
+const char* format_error(decode_error e) {
+    switch ( e ) {
+        case decode_error::ok: return "ok";
+        case decode_error::truncated: return "truncated record";
+        case decode_error::bad_prev_hash: return "bad previous hash size";
+        case decode_error::bad_hash: return "bad hash size";
+        case decode_error::bad_footer: return "bad record length";
+        default: return "NULL";
+    }
+}
+
+// bounds checked cursor over a buffer of encoded blocks, used both for the
+// file and the wire. nothing read is trusted: every length is checked against
+// the bytes left before anything is allocated, and the hashes must be 64 chars
+// (the previous hash of the root is empty).
+struct block_decoder {
+    enum: std::size_t {
+         hash_size       = sizeof(digest)*2
+        // idx, timestamp, previous hash, payload size
+        ,max_header_size = sizeof(std::uint64_t)*2 + sizeof(std::uint32_t) + hash_size + sizeof(std::uint32_t)
+        // hash
+        ,trailer_size    = sizeof(std::uint32_t) + hash_size
+    };
+
+    block_decoder(const char *p, std::size_t n)
+        :m_b{p}
+        ,m_p{p}
+        ,m_e{p + n}
+    {}
+    explicit block_decoder(const std::string &s)
+        :block_decoder(s.data(), s.size())
+    {}
+
+    std::size_t used() const { return m_p - m_b; }
+    std::size_t left() const { return m_e - m_p; }
+    bool at_end() const { return m_p == m_e; }
+
+    template<typename T>
+    bool pod(T *v) {
+        if ( left() < sizeof(T) ) {
+            return false;
+        }
+        std::memcpy(v, m_p, sizeof(T));
+        m_p += sizeof(T);
+
+        return true;
+    }
+    bool str(std::string *s) {
+        std::uint32_t size{};
+        if ( !pod(&size) || left() < size ) {
+            return false;
+        }
+        s->assign(m_p, size);
+        m_p += size;
+
+        return true;
+    }
+
+    // idx, timestamp, previous hash and the size of the payload following,
+    // which is 'pruned_payload_size' for a pruned one.
+    decode_error header(block *b, std::uint32_t *payload_size) {
+        std::uint32_t size{};
+        if ( !pod(&b->idx) || !pod(&b->timestamp) || !pod(&size) ) {
+            return decode_error::truncated;
+        }
+        if ( size != 0 && size != hash_size ) {
+            return decode_error::bad_prev_hash;
+        }
+        if ( left() < size ) {
+            return decode_error::truncated;
+        }
+        b->prevsha256.assign(m_p, size);
+        m_p += size;
+
+        return pod(payload_size) ? decode_error::ok : decode_error::truncated;
+    }
+    // the same but nothing is copied out, for the scans.
+    decode_error skip_header(std::uint32_t *payload_size) {
+        std::uint32_t size{};
+        if ( left() < sizeof(std::uint64_t)*2 ) {
+            return decode_error::truncated;
+        }
+        m_p += sizeof(std::uint64_t)*2;
+        if ( !pod(&size) ) {
+            return decode_error::truncated;
+        }
+        if ( size != 0 && size != hash_size ) {
+            return decode_error::bad_prev_hash;
+        }
+        if ( left() < size ) {
+            return decode_error::truncated;
+        }
+        m_p += size;
+
+        return pod(payload_size) ? decode_error::ok : decode_error::truncated;
+    }
+    decode_error payload(block *b, std::uint32_t size) {
+        b->pruned = size == pruned_payload_size;
+        if ( b->pruned ) {
+            b->data.clear();
+
+            return decode_error::ok;
+        }
+        if ( left() < size ) {
+            return decode_error::truncated;
+        }
+        b->data.assign(m_p, size);
+        m_p += size;
+
+        return decode_error::ok;
+    }
+    decode_error hash(block *b) {
+        const char *p{};
+        decode_error ec = hash(&p);
+        if ( ec == decode_error::ok ) {
+            b->sha256.assign(p, hash_size);
+        }
+
+        return ec;
+    }
+    // points 'p' to the 64 chars of the hash inside of the buffer.
+    decode_error hash(const char **p) {
+        std::uint32_t size{};
+        if ( !pod(&size) ) {
+            return decode_error::truncated;
+        }
+        if ( size != hash_size ) {
+            return decode_error::bad_hash;
+        }
+        if ( left() < size ) {
+            return decode_error::truncated;
+        }
+        *p = m_p;
+        m_p += size;
+
+        return decode_error::ok;
+    }
+
+    decode_error blk(block *b) {
+        std::uint32_t size{};
+        decode_error ec = header(b, &size);
+        if ( ec != decode_error::ok ) {
+            return ec;
+        }
+        if ( (ec = payload(b, size)) != decode_error::ok ) {
+            return ec;
+        }
+
+        return hash(b);
+    }
+
+private:
+    const char *m_b;
+    const char *m_p;
+    const char *m_e;
+};
+
+/*************************************************************************************************/
+
+template<typename Payload>
+std::ostream& dump(std::ostream &os, const basic_block<Payload> &b) {
     os
     << "index    = " << b.idx << std::endl
     << "timestamp= " << format_timestamp(b.timestamp) << std::endl
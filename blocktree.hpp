@@ -0,0 +1,303 @@
+
+#ifndef __blockchain__blocktree_hpp
+#define __blockchain__blocktree_hpp
+
+#include "blockchain.hpp"
+#include "sidefile.hpp"
+
+#include <cstdint>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*************************************************************************************************/
+
+// in-memory tree of all the blocks of the file, including the side branches.
+// every node keeps a link to its parent and a skip link to one of the
+// farther ancestors, so ancestor lookup does not walk the parents one by one.
+struct block_tree {
+    struct node {
+        digest hash;
+        std::uint64_t height;
+        std::uint64_t offset;
+        node *parent;
+        node *skip;
+        std::size_t children;
+    };
+
+    block_tree() = default;
+    block_tree(const block_tree &) = delete;
+    block_tree& operator= (const block_tree &) = delete;
+
+    bool empty() const { return m_map.empty(); }
+    std::size_t size() const { return m_map.size(); }
+
+    void clear() {
+        m_map.clear();
+        m_nodes.clear();
+        m_tips.clear();
+    }
+
+    // the block hash is the digest of the payload only, so equal payloads give equal hashes.
+    // a block is therefore identified by its hash together with its height,
+    // and when that is ambiguous too, the latest appended one wins.
+    node* find(const digest &hash, std::uint64_t height) const {
+        node *res = nullptr;
+        auto range = m_map.equal_range(hash);
+        for ( auto it = range.first; it != range.second; ++it ) {
+            node *n = it->second;
+            if ( n->height == height && (!res || n->offset > res->offset) ) {
+                res = n;
+            }
+        }
+
+        return res;
+    }
+    node* find_at(const digest &hash, std::uint64_t offset) const {
+        auto range = m_map.equal_range(hash);
+        for ( auto it = range.first; it != range.second; ++it ) {
+            if ( it->second->offset == offset ) {
+                return it->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // 'parent' is nullptr for the root.
+    node* insert(node *parent, const digest &hash, std::uint64_t offset) {
+        m_nodes.push_back(node{hash, parent ? parent->height+1 : 0, offset, parent, nullptr, 0});
+        node *n = &m_nodes.back();
+        m_map.emplace(n->hash, n);
+
+        if ( parent ) {
+            n->skip = ancestor(parent, skip_height(n->height));
+            if ( parent->children++ == 0 ) {
+                m_tips.erase(std::find(m_tips.begin(), m_tips.end(), parent));
+            }
+        }
+        m_tips.push_back(n);
+
+        return n;
+    }
+
+    // the nodes having no children, in the order they were appended.
+    const std::vector<node *>& tips() const { return m_tips; }
+    // all the nodes, in the order they were appended.
+    const std::deque<node>& nodes() const { return m_nodes; }
+
+    // the canonical tip: the longest chain wins, on a tie the earliest appended tip is kept.
+    node* best_tip() const {
+        node *best = nullptr;
+        for ( node *n: m_tips ) {
+            if ( !best || n->height > best->height ) {
+                best = n;
+            }
+        }
+
+        return best;
+    }
+
+    static node* ancestor(node *n, std::uint64_t height) {
+        if ( !n || height > n->height ) {
+            return nullptr;
+        }
+
+        std::uint64_t walk = n->height;
+        while ( walk > height ) {
+            std::uint64_t hskip = skip_height(walk);
+            std::uint64_t hskip_prev = skip_height(walk-1);
+            if ( n->skip && (hskip == height || (hskip > height && !(hskip_prev+2 < hskip && hskip_prev >= height))) ) {
+                n = n->skip;
+                walk = hskip;
+            } else {
+                n = n->parent;
+                --walk;
+            }
+        }
+
+        return n;
+    }
+
+    // O(depth of the fork): both sides are brought to the same height
+    // through the skip links, then walked back in lock-step.
+    static node* common_ancestor(node *a, node *b) {
+        if ( a->height > b->height ) {
+            a = ancestor(a, b->height);
+        } else if ( b->height > a->height ) {
+            b = ancestor(b, a->height);
+        }
+        while ( a != b && a && b ) {
+            a = a->parent;
+            b = b->parent;
+        }
+
+        return a;
+    }
+
+    // the height the skip link of a node at 'height' points to.
+    static std::uint64_t skip_height(std::uint64_t height) {
+        if ( height < 2 ) {
+            return 0;
+        }
+
+        return (height & 1)
+            ? invert_lowest_one(invert_lowest_one(height - 1)) + 1
+            : invert_lowest_one(height)
+        ;
+    }
+
+private:
+    static std::uint64_t invert_lowest_one(std::uint64_t n) { return n & (n - 1); }
+
+private:
+    std::deque<node> m_nodes;
+    std::unordered_multimap<digest, node *, digest_hasher> m_map;
+    std::vector<node *> m_tips;
+};
+
+/*************************************************************************************************/
+
+// the parent and skip links of the block_tree nodes kept next to the data file, one entry per
+// block in the file order. a side branch is linked in, and its fork with the canonical chain
+// is found, by reading O(depth) entries instead of loading the whole tree in every process.
+// the entries refer to each other by the file offsets of their blocks, and are found
+// by a binary search over the offsets.
+//
+// file layout: header, then the entries. 'stamp' is the data file the entries were
+// written for, when it does not match the data file they are stale and are rebuilt.
+struct link_index {
+    enum: std::uint64_t { none = ~std::uint64_t{0} };
+
+    struct header {
+        data_stamp stamp;
+    };
+    struct link {
+        std::uint64_t offset;
+        std::uint64_t height;
+        std::uint64_t parent;  // the offset of the parent, 'none' for the root
+        std::uint64_t skip;    // the offset of the skip ancestor, 'none' for the root
+    };
+
+    explicit link_index(const std::string &fname, bool read_only = false)
+        :m_file{fname, "links", read_only}
+        ,m_hdr{}
+        ,m_size{}
+    {
+        open();
+    }
+
+    void reopen() {
+        m_file.reopen();
+        open();
+    }
+
+    const data_stamp& stamp() const { return m_hdr.stamp; }
+    std::uint64_t size() const { return m_size; }
+
+    void clear() {
+        m_file.truncate(0);
+        m_hdr = header{};
+        m_size = 0;
+        m_file.write(0, &m_hdr, sizeof(m_hdr));
+    }
+
+    // in the file only, commit() makes them current (see side_file::read_header()).
+    void append(const link *links, std::size_t n) {
+        m_file.write(entry_pos(m_size), links, n*sizeof(link));
+        m_size += n;
+    }
+    void commit(const data_stamp &stamp) {
+        m_hdr.stamp = stamp;
+        m_file.write(0, &m_hdr, sizeof(m_hdr));
+    }
+
+    void read(std::uint64_t i, link *dst, std::size_t n) const {
+        m_file.read(entry_pos(i), dst, n*sizeof(link));
+    }
+
+    // false when the block at 'offset' is not in the tree.
+    bool find(std::uint64_t offset, link *res) const {
+        std::uint64_t lo = 0, hi = m_size;
+        while ( lo < hi ) {
+            const std::uint64_t mid = lo + (hi - lo) / 2;
+            link l{};
+            read(mid, &l, 1);
+            if ( l.offset < offset ) {
+                lo = mid + 1;
+            } else if ( l.offset > offset ) {
+                hi = mid;
+            } else {
+                *res = l;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // the same walks as block_tree::ancestor() and block_tree::common_ancestor().
+    // false when a link points nowhere, which a consistent file never does.
+    bool ancestor(link n, std::uint64_t height, link *res) const {
+        if ( height > n.height ) {
+            return false;
+        }
+
+        std::uint64_t walk = n.height;
+        while ( walk > height ) {
+            std::uint64_t hskip = block_tree::skip_height(walk);
+            std::uint64_t hskip_prev = block_tree::skip_height(walk-1);
+            std::uint64_t next{};
+            if ( n.skip != none && (hskip == height || (hskip > height && !(hskip_prev+2 < hskip && hskip_prev >= height))) ) {
+                next = n.skip;
+                walk = hskip;
+            } else {
+                next = n.parent;
+                --walk;
+            }
+            if ( next == none || !find(next, &n) ) {
+                return false;
+            }
+        }
+        *res = n;
+
+        return true;
+    }
+    bool common_ancestor(link a, link b, link *res) const {
+        if ( a.height > b.height && !ancestor(a, b.height, &a) ) {
+            return false;
+        }
+        if ( b.height > a.height && !ancestor(b, a.height, &b) ) {
+            return false;
+        }
+        while ( a.offset != b.offset ) {
+            if ( a.parent == none || b.parent == none || !find(a.parent, &a) || !find(b.parent, &b) ) {
+                return false;
+            }
+        }
+        *res = a;
+
+        return true;
+    }
+
+private:
+    static std::uint64_t entry_pos(std::uint64_t i) {
+        return sizeof(header) + i*sizeof(link);
+    }
+
+    void open() {
+        m_size = m_file.read_header(&m_hdr) ? m_file.entries(sizeof(m_hdr), sizeof(link)) : 0;
+    }
+
+private:
+    side_file m_file;
+    header m_hdr;
+    std::uint64_t m_size;
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__blocktree_hpp
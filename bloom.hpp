@@ -0,0 +1,164 @@
+
+#ifndef __blockchain__bloom_hpp
+#define __blockchain__bloom_hpp
+
+#include "blockchain.hpp"
+#include "sidefile.hpp"
+
+#include <cstdint>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*************************************************************************************************/
+
+// bloom filters over the block hashes, one per 'segment_records' consecutive records of the file.
+// a miss is rejected without touching the data file, a hit narrows the scan down
+// to the segments whose filter matched.
+//
+// file layout: header, then the segments one after another.
+// 'stamp' is the data file the filters were built for,
+// when it does not match the data file the filters are stale and are rebuilt.
+struct bloom_index {
+    enum: std::uint32_t {
+         segment_records = 4096
+        ,segment_words   = 640  // 10 bits per record
+        ,segment_bits    = segment_words * 64
+        ,probes          = 7    // ~0.8% false positives
+    };
+
+    struct header {
+        data_stamp stamp;
+        std::uint64_t segments;
+    };
+    struct segment {
+        std::uint64_t start;  // file offset of the first record
+        std::uint64_t count;  // number of records
+        std::uint64_t bits[segment_words];
+    };
+
+    // [file offset, number of records]
+    using range = std::pair<std::uint64_t, std::uint64_t>;
+
+    explicit bloom_index(const std::string &fname, bool read_only = false)
+        :m_file{fname, "bloom", read_only}
+        ,m_hdr{}
+        ,m_loaded{}
+        ,m_dirty_from{}
+    {
+        open();
+    }
+
+    void reopen() {
+        m_file.reopen();
+        open();
+    }
+
+    const data_stamp& stamp() const { return m_hdr.stamp; }
+
+    void clear() {
+        m_file.truncate(0);
+        m_hdr = header{};
+        m_segs.clear();
+        m_loaded = true;
+        m_dirty_from = 0;
+        m_file.write(0, &m_hdr, sizeof(m_hdr));
+    }
+
+    // in memory only, commit() writes the changes.
+    void insert(const digest &d, std::uint64_t off) {
+        load_tail();
+        if ( m_segs.empty() || m_segs.back().count == segment_records ) {
+            m_segs.push_back(segment{});
+            m_segs.back().start = off;
+            ++m_hdr.segments;
+        }
+
+        segment &s = m_segs.back();
+        const std::uint64_t h1 = d.w[1];
+        const std::uint64_t h2 = d.w[2] | 1;
+        for ( std::uint32_t i = 0; i < probes; ++i ) {
+            const std::uint64_t bit = (h1 + i*h2) % segment_bits;
+            s.bits[bit / 64] |= std::uint64_t{1} << (bit % 64);
+        }
+        ++s.count;
+    }
+    void commit(const data_stamp &stamp) {
+        const std::uint64_t first = m_hdr.segments - m_segs.size();
+        for ( std::uint64_t i = std::max(first, m_dirty_from); i < m_hdr.segments; ++i ) {
+            m_file.write(segment_pos(i), &m_segs[i - first], sizeof(segment));
+        }
+        m_hdr.stamp = stamp;
+        m_file.write(0, &m_hdr, sizeof(m_hdr));
+        m_dirty_from = m_hdr.segments ? m_hdr.segments-1 : 0;
+    }
+
+    // the segments that may contain the hash.
+    void lookup(const digest &d, std::vector<range> *ranges) {
+        load_all();
+
+        ranges->clear();
+        const std::uint64_t h1 = d.w[1];
+        const std::uint64_t h2 = d.w[2] | 1;
+        for ( const segment &s: m_segs ) {
+            bool hit = true;
+            for ( std::uint32_t i = 0; i < probes && hit; ++i ) {
+                const std::uint64_t bit = (h1 + i*h2) % segment_bits;
+                hit = (s.bits[bit / 64] >> (bit % 64)) & 1;
+            }
+            if ( hit ) {
+                ranges->emplace_back(s.start, s.count);
+            }
+        }
+    }
+
+private:
+    static std::uint64_t segment_pos(std::uint64_t i) {
+        return sizeof(header) + i*sizeof(segment);
+    }
+
+    void open() {
+        m_segs.clear();
+        m_loaded = false;
+        if ( m_file.read_header(&m_hdr) && m_file.size() != segment_pos(m_hdr.segments) ) {
+            // segments missing or left over by a torn commit, unusable as well
+            m_hdr = header{};
+        }
+        m_dirty_from = m_hdr.segments ? m_hdr.segments-1 : 0;
+    }
+
+    // only the last segment is needed to append.
+    void load_tail() {
+        if ( m_loaded || !m_segs.empty() || !m_hdr.segments ) {
+            return;
+        }
+
+        m_segs.resize(1);
+        m_file.read(segment_pos(m_hdr.segments-1), &m_segs[0], sizeof(segment));
+    }
+    void load_all() {
+        if ( m_loaded ) {
+            return;
+        }
+
+        m_segs.resize(m_hdr.segments);
+        if ( m_hdr.segments ) {
+            m_file.read(segment_pos(0), m_segs.data(), m_hdr.segments*sizeof(segment));
+        }
+        m_loaded = true;
+    }
+
+private:
+    side_file m_file;
+    header m_hdr;
+    // all the segments when 'm_loaded', otherwise empty or just the last one
+    std::vector<segment> m_segs;
+    bool m_loaded;
+    std::uint64_t m_dirty_from;
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__bloom_hpp
@@ -0,0 +1,188 @@
+
+#include "blockchain.hpp"
+#include "layout.hpp"
+#include "reader.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// libFuzzer target for the block codec. the input is taken both as a wire buffer
+// for block_decoder and as the contents of a data file for the record layouts.
+//
+// built with -DBLOCKCHAIN_FUZZ_DRIVER when libFuzzer is not available: main() then
+// runs the files and directories given on the command line once each, '-' options are ignored.
+
+namespace {
+
+bool operator== (const block &l, const block &r) {
+    return l.idx == r.idx
+        && l.timestamp == r.timestamp
+        && l.prevsha256 == r.prevsha256
+        && l.data == r.data
+        && l.sha256 == r.sha256
+        && l.pruned == r.pruned
+    ;
+}
+
+// every block decoded from the buffer encodes back to the very bytes it was decoded from.
+void fuzz_decoder(const char *p, std::size_t n) {
+    block_decoder dec{p, n};
+    for ( ;; ) {
+        const std::size_t start = dec.used();
+        block b{};
+        if ( dec.blk(&b) != decode_error::ok ) {
+            break;
+        }
+
+        std::string buf;
+        encode_block(buf, b);
+        if ( buf.size() != dec.used() - start || std::memcmp(buf.data(), p + start, buf.size()) != 0 ) {
+            std::abort();
+        }
+        block_decoder again{buf};
+        block d{};
+        if ( again.blk(&d) != decode_error::ok || !(d == b) ) {
+            std::abort();
+        }
+    }
+}
+
+template<typename Layout>
+void fuzz_file(int fd, std::uint64_t size) {
+    file_reader r{4096};
+    r.attach(fd);
+
+    try {
+        while ( r.tell() < size ) {
+            const block b = Layout::read(r, size);
+            if ( r.tell() > size || b.data.size() > size ) {
+                std::abort();
+            }
+        }
+    } catch (const std::runtime_error &) {}
+
+    try {
+        r.seek(0);
+        digest d{};
+        while ( r.tell() < size ) {
+            Layout::read_hash(r, size, &d);
+            if ( r.tell() > size ) {
+                std::abort();
+            }
+        }
+    } catch (const std::runtime_error &) {}
+
+    try {
+        std::uint64_t end = size, start{};
+        while ( end && Layout::record_start(r, end, &start) ) {
+            if ( start >= end ) {
+                std::abort();
+            }
+            end = start;
+        }
+    } catch (const std::runtime_error &) {}
+}
+
+} // ns
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size) {
+    const char *p = reinterpret_cast<const char *>(data);
+    fuzz_decoder(p, size);
+
+    static int fd = ::memfd_create("codec_fuzz", 0);
+    if ( fd == -1
+        || ::ftruncate(fd, 0) != 0
+        || ::pwrite(fd, p, size, 0) != static_cast<ssize_t>(size) )
+    {
+        std::abort();
+    }
+    fuzz_file<variable_layout>(fd, size);
+    fuzz_file<legacy_layout>(fd, size);
+
+    return 0;
+}
+
+/*************************************************************************************************/
+
+#ifdef BLOCKCHAIN_FUZZ_DRIVER
+
+#include <iostream>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+
+bool run_file(const std::string &fname) {
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if ( fd == -1 ) {
+        return false;
+    }
+    struct stat st{};
+    std::vector<std::uint8_t> buf;
+    bool ok = ::fstat(fd, &st) == 0;
+    if ( ok ) {
+        buf.resize(st.st_size);
+        ok = ::pread(fd, buf.data(), buf.size(), 0) == static_cast<ssize_t>(buf.size());
+    }
+    ::close(fd);
+    if ( ok ) {
+        LLVMFuzzerTestOneInput(buf.data(), buf.size());
+    }
+
+    return ok;
+}
+
+bool run_path(const std::string &path, std::size_t *runs) {
+    DIR *d = ::opendir(path.c_str());
+    if ( !d ) {
+        ++*runs;
+
+        return run_file(path);
+    }
+
+    bool ok = true;
+    while ( dirent *e = ::readdir(d) ) {
+        if ( e->d_name[0] != '.' ) {
+            ok = run_path(path + "/" + e->d_name, runs) && ok;
+        }
+    }
+    ::closedir(d);
+
+    return ok;
+}
+
+} // ns
+
+int main(int argc, char **argv) {
+    std::size_t runs{};
+    bool ok = true;
+    for ( int i = 1; i < argc; ++i ) {
+        if ( argv[i][0] == '-' ) {
+            continue;
+        }
+        if ( !run_path(argv[i], &runs) ) {
+            std::cout << "can't read " << argv[i] << std::endl;
+            ok = false;
+        }
+    }
+    std::cout << runs << " inputs run" << std::endl;
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // BLOCKCHAIN_FUZZ_DRIVER
+
+/*************************************************************************************************/
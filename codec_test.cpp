@@ -0,0 +1,410 @@
+
+#include "blockchain.hpp"
+#include "layout.hpp"
+#include "reader.hpp"
+#include "storage.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// the block codec tests.
+//
+// usage: codec_test [roundtrip|throughput]
+//   roundtrip  - the round-trip properties of encode_block()/block_decoder and of
+//                the records of variable_layout and legacy_layout, over random blocks
+//   throughput - a full scan through storage against the fread() based reader the
+//                decoder replaced, fails when the decoder is the slower one
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if ( !(cond) ) { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+/*************************************************************************************************/
+
+std::string random_hex(std::mt19937_64 &rng) {
+    static const char alphabet[] = "0123456789abcdef";
+    std::string s(block_decoder::hash_size, '\0');
+    for ( auto &c: s ) {
+        c = alphabet[rng() % 16];
+    }
+
+    return s;
+}
+
+// the payloads include the empty one, the pruned one and, now and then,
+// one bigger than the read-ahead window of file_reader.
+block random_block(std::mt19937_64 &rng) {
+    block b{};
+    b.idx = rng();
+    b.timestamp = rng();
+    if ( rng() % 4 ) {
+        b.prevsha256 = random_hex(rng);
+    }
+
+    std::size_t size{};
+    switch ( rng() % 16 ) {
+        case 0: size = 0; break;
+        case 1: size = file_reader::default_buffer_size + rng() % 4096; break;
+        case 2: size = rng() % 65536; break;
+        default: size = rng() % 512; break;
+    }
+    b.data.resize(size);
+    for ( auto &c: b.data ) {
+        c = static_cast<char>(rng());
+    }
+    b.sha256 = random_hex(rng);
+    if ( rng() % 8 == 0 ) {
+        b.pruned = true;
+        b.data.clear();
+    }
+
+    return b;
+}
+
+bool operator== (const block &l, const block &r) {
+    return l.idx == r.idx
+        && l.timestamp == r.timestamp
+        && l.prevsha256 == r.prevsha256
+        && l.data == r.data
+        && l.sha256 == r.sha256
+        && l.pruned == r.pruned
+    ;
+}
+
+// an unlinked temporary file.
+int temp_file() {
+    char name[] = "/tmp/codec_test.XXXXXX";
+    int fd = ::mkstemp(name);
+    if ( fd == -1 ) {
+        throw std::runtime_error("can't create temporary file");
+    }
+    ::unlink(name);
+
+    return fd;
+}
+
+void write_file(int fd, const std::string &buf) {
+    if ( ::ftruncate(fd, 0) != 0 || ::pwrite(fd, buf.data(), buf.size(), 0) != static_cast<ssize_t>(buf.size()) ) {
+        throw std::runtime_error("can't write temporary file");
+    }
+}
+
+/*************************************************************************************************/
+
+// decode(encode(b)) == b, and every strict prefix of the encoding is reported as truncated.
+void check_block_roundtrip(std::mt19937_64 &rng) {
+    for ( int i = 0; i < 2000; ++i ) {
+        const block b = random_block(rng);
+        std::string buf;
+        encode_block(buf, b);
+
+        block_decoder dec{buf};
+        block d{};
+        CHECK(dec.blk(&d) == decode_error::ok);
+        CHECK(d == b);
+        CHECK(dec.at_end());
+
+        // all the cuts of the small records, a sample of the big ones
+        const std::size_t step = buf.size() > 4096 ? buf.size() / 64 : 1;
+        for ( std::size_t len = 0; len < buf.size(); len += step ) {
+            block_decoder cut{buf.data(), len};
+            CHECK(cut.blk(&d) == decode_error::truncated);
+        }
+    }
+}
+
+// the records of a file read back forwards and, with the footer, backwards.
+// the footer-less files are recognised as such.
+template<typename Layout>
+void check_file_roundtrip(std::mt19937_64 &rng, std::size_t bufsize) {
+    int fd = temp_file();
+    for ( int round = 0; round < 20; ++round ) {
+        std::vector<block> blocks(1 + rng() % 64);
+        std::vector<std::uint64_t> offs;
+        std::string buf;
+        for ( auto &b: blocks ) {
+            b = random_block(rng);
+            offs.push_back(buf.size());
+            Layout::encode(buf, b);
+        }
+        write_file(fd, buf);
+
+        file_reader r{bufsize};
+        r.attach(fd);
+        // a file written before the footer is told apart from one with it
+        CHECK(variable_layout::detect(r, buf.size()) == (Layout::footer_size != 0));
+
+        r.seek(0);
+        for ( const auto &b: blocks ) {
+            CHECK(Layout::read(r, buf.size()) == b);
+        }
+        CHECK(r.tell() == buf.size());
+
+        r.seek(0);
+        for ( const auto &b: blocks ) {
+            digest expected{}, d{};
+            CHECK(parse_digest(&expected, b.sha256));
+            CHECK(Layout::read_hash(r, buf.size(), &d));
+            CHECK(d == expected);
+        }
+        CHECK(r.tell() == buf.size());
+
+        std::uint64_t end = buf.size();
+        for ( auto it = offs.rbegin(); it != offs.rend(); ++it ) {
+            std::uint64_t start{};
+            const bool known = Layout::record_start(r, end, &start);
+            CHECK(known == (Layout::footer_size != 0));
+            if ( !known ) {
+                break;
+            }
+            CHECK(start == *it);
+            end = start;
+        }
+    }
+    ::close(fd);
+}
+
+// a damaged record is either read or rejected with runtime_error, never read past 'end',
+// and a length field can't make the reader allocate more than the file holds.
+void check_corrupt_records(std::mt19937_64 &rng) {
+    int fd = temp_file();
+    for ( int round = 0; round < 2000; ++round ) {
+        std::string buf;
+        for ( int i = 0; i < 4; ++i ) {
+            variable_layout::encode(buf, random_block(rng));
+        }
+        switch ( rng() % 3 ) {
+            case 0: {
+                buf[rng() % buf.size()] ^= static_cast<char>(1 + rng() % 255);
+                break;
+            }
+            case 1: {
+                const std::uint32_t len = rng() % 2 ? 0xfffffffeu : static_cast<std::uint32_t>(rng());
+                std::memcpy(&buf[rng() % (buf.size() - sizeof(len))], &len, sizeof(len));
+                break;
+            }
+            default: {
+                buf.resize(rng() % buf.size());
+                break;
+            }
+        }
+        write_file(fd, buf);
+
+        file_reader r{4096};
+        r.attach(fd);
+        try {
+            while ( r.tell() < buf.size() ) {
+                const block b = variable_layout::read(r, buf.size());
+                CHECK(b.data.size() <= buf.size());
+                CHECK(r.tell() <= buf.size());
+            }
+        } catch (const std::runtime_error &) {}
+
+        try {
+            std::uint64_t end = buf.size(), start{};
+            while ( end && variable_layout::record_start(r, end, &start) ) {
+                CHECK(start < end);
+                end = start;
+            }
+        } catch (const std::runtime_error &) {}
+    }
+    ::close(fd);
+}
+
+int roundtrip() {
+    std::mt19937_64 rng{20240601};
+
+    check_block_roundtrip(rng);
+    check_file_roundtrip<variable_layout>(rng, file_reader::default_buffer_size);
+    check_file_roundtrip<variable_layout>(rng, 4096);
+    check_file_roundtrip<legacy_layout>(rng, file_reader::default_buffer_size);
+    check_file_roundtrip<legacy_layout>(rng, 4096);
+    check_corrupt_records(rng);
+
+    std::cout << (failures ? "FAILED" : "passed") << std::endl;
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*************************************************************************************************/
+
+// the reader the decoder replaced: stdio with the lengths trusted as they are,
+// plus the record length footer it did not know of.
+struct stdio_reader {
+    explicit stdio_reader(const std::string &fname)
+        :m_file{std::fopen(fname.c_str(), "rb")}
+    {
+        if ( !m_file ) {
+            throw std::runtime_error("can't open file");
+        }
+    }
+    ~stdio_reader() {
+        std::fclose(m_file);
+    }
+
+    std::string read_string() {
+        std::uint32_t size{};
+        std::fread(&size, 1, sizeof(size), m_file);
+        std::string s;
+        if ( size != pruned_payload_size ) {
+            s.resize(size);
+            std::fread(&s[0], 1, size, m_file);
+        }
+
+        return s;
+    }
+    block read_block() {
+        block b;
+        std::fread(&b.idx, 1, sizeof(b.idx), m_file);
+        std::fread(&b.timestamp, 1, sizeof(b.timestamp), m_file);
+        b.prevsha256 = read_string();
+        b.data = read_string();
+        b.sha256 = read_string();
+        std::uint64_t len{};
+        std::fread(&len, 1, sizeof(len), m_file);
+
+        return b;
+    }
+
+    std::FILE *m_file;
+};
+
+void remove_dir(const std::string &dir) {
+    if ( DIR *d = ::opendir(dir.c_str()) ) {
+        while ( dirent *e = ::readdir(d) ) {
+            if ( std::strcmp(e->d_name, ".") && std::strcmp(e->d_name, "..") ) {
+                ::unlink((dir + "/" + e->d_name).c_str());
+            }
+        }
+        ::closedir(d);
+    }
+    ::rmdir(dir.c_str());
+}
+
+// the best of five full scans, in blocks per second.
+template<typename F>
+double scan_rate(std::uint64_t nblocks, F scan) {
+    double best{};
+    for ( int run = 0; run < 5; ++run ) {
+        const auto start = std::chrono::steady_clock::now();
+        const std::uint64_t n = scan();
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        if ( n != nblocks ) {
+            throw std::runtime_error("the scan did not see all the blocks");
+        }
+        best = std::max(best, n / secs.count());
+    }
+
+    return best;
+}
+
+bool compare_scans(const std::string &dir, std::uint64_t nblocks, std::size_t payload) {
+    const std::string fname = dir + "/blockchain.dat";
+    ::storage st{fname.c_str()};
+    {
+        std::vector<block> blocks;
+        std::string prev;
+        const std::string data(payload, 'x');
+        for ( std::uint64_t i = 0; i < nblocks; ++i ) {
+            blocks.push_back(new_block(prev, i, data.data(), data.size()));
+            prev = blocks.back().sha256;
+        }
+        if ( st.add(blocks) != ::storage::add_error::ok ) {
+            throw std::runtime_error("can't fill the storage");
+        }
+    }
+
+    const double decoder = scan_rate(nblocks, [&st] {
+        std::uint64_t n = 1;
+        for ( st.first(); !st.at_end(); st.next() ) {
+            ++n;
+        }
+
+        return n;
+    });
+    const double baseline = scan_rate(nblocks, [&fname, nblocks] {
+        stdio_reader r{fname};
+        std::uint64_t n = 0;
+        for ( ; n < nblocks; ++n ) {
+            r.read_block();
+        }
+
+        return n;
+    });
+
+    std::cout
+    << nblocks << " blocks of " << payload << " bytes: "
+    << "block_decoder=" << static_cast<std::uint64_t>(decoder) << "/s, "
+    << "stdio=" << static_cast<std::uint64_t>(baseline) << "/s"
+    << std::endl;
+
+    return decoder >= baseline;
+}
+
+int throughput() {
+    char tmpl[] = "/tmp/codec_test.XXXXXX";
+    if ( !::mkdtemp(tmpl) ) {
+        std::cout << "can't create temporary directory" << std::endl;
+
+        return EXIT_FAILURE;
+    }
+    const std::string dir = tmpl;
+
+    bool ok{};
+    try {
+        ok = compare_scans(dir, 200000, 64);
+        remove_dir(dir);
+        ::mkdir(dir.c_str(), 0755);
+        ok = compare_scans(dir, 20000, 4096) && ok;
+    } catch (...) {
+        remove_dir(dir);
+        throw;
+    }
+    remove_dir(dir);
+
+    std::cout << (ok ? "passed" : "FAILED: block_decoder is slower") << std::endl;
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*************************************************************************************************/
+
+int main(int argc, char **argv) try {
+    const std::string mode = argc > 1 ? argv[1] : "roundtrip";
+    if ( mode == "roundtrip" ) {
+        return roundtrip();
+    }
+    if ( mode == "throughput" ) {
+        return throughput();
+    }
+
+    std::cout << "usage: " << argv[0] << " [roundtrip|throughput]" << std::endl;
+
+    return EXIT_FAILURE;
+} catch (const std::exception &ex) {
+    std::cout << "std::exception: " << ex.what() << std::endl;
+    return EXIT_FAILURE;
+}
+
+/*************************************************************************************************/
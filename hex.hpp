@@ -0,0 +1,244 @@
+
+#ifndef __blockchain__hex_hpp
+#define __blockchain__hex_hpp
+
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#   include <immintrin.h>
+#endif
+
+/*************************************************************************************************/
+
+// hex encoding/decoding. the vector path is picked at compile time:
+// AVX2 when built with -mavx2 (or -march=native on a capable CPU), SSE2 on any x86-64,
+// otherwise the scalar loop. the tails shorter than a vector always go through the scalar loop.
+
+namespace detail {
+
+inline
+void hex_encode_scalar(const std::uint8_t *src, std::size_t n, char *dst) {
+    static const char digits[] = "0123456789abcdef";
+    for ( std::size_t i = 0; i < n; ++i ) {
+        dst[i*2]   = digits[src[i] >> 4];
+        dst[i*2+1] = digits[src[i] & 0x0f];
+    }
+}
+
+inline
+int hex_value(char c) {
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    c |= 0x20;
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+
+    return -1;
+}
+
+inline
+bool hex_decode_scalar(const char *src, std::size_t n, std::uint8_t *dst) {
+    for ( std::size_t i = 0; i < n; ++i ) {
+        const int hi = hex_value(src[i*2]);
+        const int lo = hex_value(src[i*2+1]);
+        if ( (hi | lo) < 0 ) {
+            return false;
+        }
+        dst[i] = static_cast<std::uint8_t>((hi << 4) | lo);
+    }
+
+    return true;
+}
+
+#if defined(__AVX2__)
+
+// the nibbles to ascii: '0'+v, plus ('a'-'0'-10) where v > 9
+inline
+__m256i hex_nibbles_to_ascii(__m256i v) {
+    const __m256i gt9 = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(9));
+
+    return _mm256_add_epi8(
+         _mm256_add_epi8(v, _mm256_set1_epi8('0'))
+        ,_mm256_and_si256(gt9, _mm256_set1_epi8('a' - '0' - 10))
+    );
+}
+
+// 32 bytes to 64 chars
+inline
+void hex_encode_32(const std::uint8_t *src, char *dst) {
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+    const __m256i hi = hex_nibbles_to_ascii(_mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+    const __m256i lo = hex_nibbles_to_ascii(_mm256_and_si256(x, mask));
+
+    // the unpacks work inside of the 128-bit lanes, so the halves are put back in order after
+    const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 32), _mm256_permute2x128_si256(a, b, 0x31));
+}
+
+// 32 chars to nibble values, 'ok' is cleared when any of the chars is not a hex digit
+inline
+__m256i hex_ascii_to_nibbles(__m256i c, bool *ok) {
+    const __m256i is_digit = _mm256_and_si256(
+         _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1))
+        ,_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c)
+    );
+    const __m256i lc = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    const __m256i is_alpha = _mm256_and_si256(
+         _mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a' - 1))
+        ,_mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lc)
+    );
+    if ( _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != -1 ) {
+        *ok = false;
+    }
+
+    return _mm256_or_si256(
+         _mm256_and_si256(is_digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0')))
+        ,_mm256_andnot_si256(is_digit, _mm256_sub_epi8(lc, _mm256_set1_epi8('a' - 10)))
+    );
+}
+
+// 64 chars to 32 bytes
+inline
+bool hex_decode_32(const char *src, std::uint8_t *dst) {
+    bool ok = true;
+    const __m256i v0 = hex_ascii_to_nibbles(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)), &ok);
+    const __m256i v1 = hex_ascii_to_nibbles(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 32)), &ok);
+    if ( !ok ) {
+        return false;
+    }
+
+    // every 16-bit word holds (high nibble, low nibble), fold it into its low byte
+    const __m256i lowbyte = _mm256_set1_epi16(0x00ff);
+    const __m256i w0 = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v0, lowbyte), 4), _mm256_srli_epi16(v0, 8));
+    const __m256i w1 = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v1, lowbyte), 4), _mm256_srli_epi16(v1, 8));
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(w0, w1), 0xd8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), packed);
+
+    return true;
+}
+
+enum: std::size_t { hex_block = 32 };
+
+#elif defined(__SSE2__)
+
+inline
+__m128i hex_nibbles_to_ascii(__m128i v) {
+    const __m128i gt9 = _mm_cmpgt_epi8(v, _mm_set1_epi8(9));
+
+    return _mm_add_epi8(
+         _mm_add_epi8(v, _mm_set1_epi8('0'))
+        ,_mm_and_si128(gt9, _mm_set1_epi8('a' - '0' - 10))
+    );
+}
+
+// 16 bytes to 32 chars
+inline
+void hex_encode_16(const std::uint8_t *src, char *dst) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    const __m128i hi = hex_nibbles_to_ascii(_mm_and_si128(_mm_srli_epi16(x, 4), mask));
+    const __m128i lo = hex_nibbles_to_ascii(_mm_and_si128(x, mask));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+inline
+__m128i hex_ascii_to_nibbles(__m128i c, bool *ok) {
+    const __m128i is_digit = _mm_and_si128(
+         _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1))
+        ,_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1))
+    );
+    const __m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    const __m128i is_alpha = _mm_and_si128(
+         _mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1))
+        ,_mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1))
+    );
+    if ( _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff ) {
+        *ok = false;
+    }
+
+    return _mm_or_si128(
+         _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0')))
+        ,_mm_andnot_si128(is_digit, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10)))
+    );
+}
+
+// 32 chars to 16 bytes
+inline
+bool hex_decode_16(const char *src, std::uint8_t *dst) {
+    bool ok = true;
+    const __m128i v0 = hex_ascii_to_nibbles(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src)), &ok);
+    const __m128i v1 = hex_ascii_to_nibbles(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16)), &ok);
+    if ( !ok ) {
+        return false;
+    }
+
+    const __m128i lowbyte = _mm_set1_epi16(0x00ff);
+    const __m128i w0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v0, lowbyte), 4), _mm_srli_epi16(v0, 8));
+    const __m128i w1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1, lowbyte), 4), _mm_srli_epi16(v1, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(w0, w1));
+
+    return true;
+}
+
+enum: std::size_t { hex_block = 16 };
+
+#endif
+
+} // ns detail
+
+/*************************************************************************************************/
+
+// 'n' bytes from 'src' to 2*'n' lowercase chars into 'dst'.
+inline
+void hex_encode(const std::uint8_t *src, std::size_t n, char *dst) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for ( ; i + detail::hex_block <= n; i += detail::hex_block ) {
+        detail::hex_encode_32(src + i, dst + i*2);
+    }
+#elif defined(__SSE2__)
+    for ( ; i + detail::hex_block <= n; i += detail::hex_block ) {
+        detail::hex_encode_16(src + i, dst + i*2);
+    }
+#endif
+    detail::hex_encode_scalar(src + i, n - i, dst + i*2);
+}
+
+inline
+std::string hex_encode(const std::uint8_t *src, std::size_t n) {
+    std::string s(n*2, '\0');
+    hex_encode(src, n, &s[0]);
+
+    return s;
+}
+
+// 2*'n' chars of any case from 'src' to 'n' bytes into 'dst'. false on a non-hex char.
+inline
+bool hex_decode(const char *src, std::size_t n, std::uint8_t *dst) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for ( ; i + detail::hex_block <= n; i += detail::hex_block ) {
+        if ( !detail::hex_decode_32(src + i*2, dst + i) ) {
+            return false;
+        }
+    }
+#elif defined(__SSE2__)
+    for ( ; i + detail::hex_block <= n; i += detail::hex_block ) {
+        if ( !detail::hex_decode_16(src + i*2, dst + i) ) {
+            return false;
+        }
+    }
+#endif
+
+    return detail::hex_decode_scalar(src + i*2, n - i, dst + i);
+}
+
+/*************************************************************************************************/
+
+#endif // __blockchain__hex_hpp
@@ -0,0 +1,115 @@
+
+#include "hex.hpp"
+
+#include "picosha2.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/*************************************************************************************************/
+
+// hex encoding/decoding throughput, in MB/s of binary data, of the path hex.hpp was compiled with
+// against the scalar loop and the ostringstream-based picosha2::bytes_to_hex_string().
+// built twice: 'hex_bench' with the default flags (SSE2 on x86-64) and 'hex_bench_avx2' with -mavx2.
+//
+// usage: hex_bench [MB to process per measurement, 256 by default]
+
+#if defined(__AVX2__)
+static const char *vector_path = "avx2";
+#elif defined(__SSE2__)
+static const char *vector_path = "sse2";
+#else
+static const char *vector_path = "scalar";
+#endif
+
+enum: std::size_t { buffer_size = 1024*1024 };
+
+// the best of five runs over 'total' bytes of input.
+double measure(std::size_t total, const std::function<void()> &pass) {
+    double best{};
+    for ( int run = 0; run < 5; ++run ) {
+        const auto start = std::chrono::steady_clock::now();
+        for ( std::size_t done = 0; done < total; done += buffer_size ) {
+            pass();
+        }
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        const double mbs = total / secs.count() / (1024*1024);
+        if ( mbs > best ) {
+            best = mbs;
+        }
+    }
+
+    return best;
+}
+
+void report(const char *op, const char *path, double mbs) {
+    std::cout << op << " " << path << ": " << static_cast<std::uint64_t>(mbs) << " MB/s" << std::endl;
+}
+
+/*************************************************************************************************/
+
+int main(int argc, char **argv) {
+#if defined(__AVX2__)
+    if ( !__builtin_cpu_supports("avx2") ) {
+        std::cout << "the CPU has no AVX2, skipped" << std::endl;
+
+        return EXIT_SUCCESS;
+    }
+#endif
+    const std::size_t total = (argc > 1 ? std::stoul(argv[1]) : 256) * 1024*1024;
+
+    std::vector<std::uint8_t> bytes(buffer_size);
+    std::mt19937 rng{42};
+    for ( auto &b: bytes ) {
+        b = static_cast<std::uint8_t>(rng());
+    }
+    std::string hex(buffer_size*2, '\0');
+    std::vector<std::uint8_t> back(buffer_size);
+
+    // every path must agree before it's timed
+    const std::string expected = picosha2::bytes_to_hex_string(bytes.begin(), bytes.end());
+    detail::hex_encode_scalar(bytes.data(), bytes.size(), &hex[0]);
+    const bool scalar_ok = hex == expected;
+    hex_encode(bytes.data(), bytes.size(), &hex[0]);
+    const bool vector_ok = hex == expected
+        && hex_decode(hex.data(), back.size(), back.data()) && back == bytes
+        && detail::hex_decode_scalar(hex.data(), back.size(), back.data()) && back == bytes
+    ;
+    if ( !scalar_ok || !vector_ok ) {
+        std::cout << "the " << (scalar_ok ? vector_path : "scalar") << " path disagrees with picosha2" << std::endl;
+
+        return EXIT_FAILURE;
+    }
+
+    // the ostringstream path is slow enough for a smaller sample to do
+    report("encode", "picosha2", measure(total / 64, [&] {
+        hex = picosha2::bytes_to_hex_string(bytes.begin(), bytes.end());
+    }));
+    report("encode", "scalar", measure(total, [&] {
+        detail::hex_encode_scalar(bytes.data(), bytes.size(), &hex[0]);
+    }));
+    report("encode", vector_path, measure(total, [&] {
+        hex_encode(bytes.data(), bytes.size(), &hex[0]);
+    }));
+
+    // decoding is measured in the bytes it produces, the same as encoding consumes
+    bool ok = true;
+    report("decode", "scalar", measure(total, [&] {
+        ok = detail::hex_decode_scalar(hex.data(), back.size(), back.data()) && ok;
+    }));
+    report("decode", vector_path, measure(total, [&] {
+        ok = hex_decode(hex.data(), back.size(), back.data()) && ok;
+    }));
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*************************************************************************************************/
@@ -0,0 +1,195 @@
+
+#ifndef __blockchain__import_hpp
+#define __blockchain__import_hpp
+
+#include "blockchain.hpp"
+#include "blocktree.hpp"
+#include "ingest.hpp"
+#include "layout.hpp"
+#include "reader.hpp"
+#include "storage.hpp"
+
+#include <cstdint>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// bulk import: the payloads of a source are re-chained on top of the canonical tip
+// of 'dst' (the root of an empty one) through an ingest_pipeline. the payloads are re-hashed
+// in parallel, idx and previous hash are assigned in order, the blocks keep their timestamps.
+// the blocks are appended in batches, each with a single write followed by the index,
+// the filters and the tip record. a pruned block is taken by the payload digest it keeps.
+//
+// 'progress' is called about every second with the pipeline counters.
+
+using import_progress = std::function<void(const ingest_stats &)>;
+
+namespace detail {
+
+struct import_reporter {
+    explicit import_reporter(const import_progress &progress)
+        :m_progress(progress)
+        ,m_last{std::chrono::steady_clock::now()}
+        ,m_n{}
+    {}
+
+    void operator()(const ingest_pipeline &pipeline) {
+        if ( !m_progress || (++m_n & 0xfff) != 0 ) {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if ( now - m_last >= std::chrono::seconds(1) ) {
+            m_last = now;
+            m_progress(pipeline.stats());
+        }
+    }
+
+private:
+    const import_progress &m_progress;
+    std::chrono::steady_clock::time_point m_last;
+    std::uint64_t m_n;
+};
+
+inline
+std::string take_payload(std::string &p) {
+    return std::move(p);
+}
+template<std::size_t N>
+std::string take_payload(std::array<char, N> &p) {
+    return std::string(p.data(), N);
+}
+
+// the source is opened read-only, nothing is ever written next to it.
+inline
+int open_source(const std::string &fname, std::uint64_t *size) {
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if ( fd == -1 ) {
+        throw std::runtime_error("can't open " + fname);
+    }
+    struct stat st{};
+    if ( ::fstat(fd, &st) != 0 ) {
+        ::close(fd);
+        throw std::runtime_error("can't stat " + fname);
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    *size = st.st_size;
+
+    return fd;
+}
+
+template<typename Block>
+void import_block(ingest_pipeline &pipeline, Block &b) {
+    if ( b.pruned ) {
+        pipeline.submit_pruned(std::move(b.sha256), b.timestamp);
+    } else {
+        pipeline.submit(take_payload(b.data), b.timestamp);
+    }
+}
+
+} // ns detail
+
+// the canonical chain of the file 'fname', side branches are left out.
+// the file is only read: it's not opened as a storage, which would write
+// its side files, so the canonical chain is found by a pass over it of its own,
+// and a second pass reads the canonical blocks. a torn tail is left out.
+template<typename Layout>
+ingest_stats import_chain(
+     storage &dst
+    ,const std::string &fname
+    ,const import_progress &progress = import_progress()
+    ,std::size_t hashers = std::thread::hardware_concurrency())
+{
+    std::uint64_t size{};
+    int fd = detail::open_source(fname, &size);
+    try {
+        file_reader reader;
+        reader.attach(fd);
+
+        std::vector<std::uint64_t> offs;
+        {
+            block_tree tree;
+            const std::uint64_t end = basic_storage<Layout>::scan_tree(reader, size, &tree);
+            if ( block_tree::node *tip = tree.best_tip() ) {
+                offs.resize(tip->height+1);
+                for ( block_tree::node *n = tip; n; n = n->parent ) {
+                    offs[n->height] = n->offset;
+                }
+            }
+            size = end;
+        }
+
+        ingest_pipeline pipeline(dst, hashers);
+        detail::import_reporter report{progress};
+        for ( std::uint64_t off: offs ) {
+            reader.seek(off);
+            typename Layout::block_type b = Layout::read(reader, size);
+            detail::import_block(pipeline, b);
+            report(pipeline);
+        }
+        pipeline.finish();
+        ::close(fd);
+
+        return pipeline.stats();
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+// the records of the file 'fname' in the file order, side branches included, without
+// opening it as a storage: for a file whose index can't be rebuilt, for example
+// a damaged one. stops at the first malformed record, '*end' is its offset
+// (the size of the file when all of them were imported).
+template<typename Layout>
+ingest_stats import_records(
+     storage &dst
+    ,const std::string &fname
+    ,std::uint64_t *end
+    ,const import_progress &progress = import_progress()
+    ,std::size_t hashers = std::thread::hardware_concurrency())
+{
+    std::uint64_t size{};
+    int fd = detail::open_source(fname, &size);
+    file_reader reader;
+    reader.attach(fd);
+    try {
+        ingest_pipeline pipeline(dst, hashers);
+        detail::import_reporter report{progress};
+        while ( reader.tell() < size ) {
+            const std::uint64_t off = reader.tell();
+            typename Layout::block_type b;
+            try {
+                b = Layout::read(reader, size);
+            } catch (const std::runtime_error &) {
+                reader.seek(off);
+                break;
+            }
+            detail::import_block(pipeline, b);
+            report(pipeline);
+        }
+        pipeline.finish();
+        *end = reader.tell();
+        ::close(fd);
+
+        return pipeline.stats();
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+/*************************************************************************************************/
+
+#endif // __blockchain__import_hpp
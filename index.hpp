@@ -0,0 +1,77 @@
+
+#ifndef __blockchain__index_hpp
+#define __blockchain__index_hpp
+
+#include "blockchain.hpp"
+#include "sidefile.hpp"
+
+#include <cstdint>
+
+#include <string>
+
+/*************************************************************************************************/
+
+// flat on-disk array of 'Entry', the entry 'i' belongs to the canonical block with idx 'i'.
+template<typename Entry>
+struct flat_index {
+    explicit flat_index(const std::string &fname, bool read_only = false)
+        :m_file{fname, "index", read_only}
+        ,m_size{}
+    {
+        open();
+    }
+
+    void reopen() {
+        m_file.reopen();
+        open();
+    }
+
+    const std::string& fname() const { return m_file.fname(); }
+
+    bool empty() const { return m_size == 0; }
+    std::uint64_t size() const { return m_size; }
+
+    Entry at(std::uint64_t i) const {
+        Entry e{};
+        read(i, &e, 1);
+
+        return e;
+    }
+    Entry back() const { return at(m_size-1); }
+    void read(std::uint64_t i, Entry *dst, std::size_t n) const {
+        m_file.read(i*sizeof(Entry), dst, n*sizeof(Entry));
+    }
+
+    void push_back(const Entry &e) {
+        append(&e, 1);
+    }
+    void append(const Entry *entries, std::size_t n) {
+        m_file.write(m_size*sizeof(Entry), entries, n*sizeof(Entry));
+        m_size += n;
+    }
+    void flush() {
+        m_file.flush();
+    }
+    void truncate(std::uint64_t n) {
+        m_file.truncate(n*sizeof(Entry));
+        m_size = n;
+    }
+
+private:
+    void open() {
+        m_size = m_file.entries(0, sizeof(Entry));
+    }
+
+private:
+    side_file m_file;
+    std::uint64_t m_size;
+};
+
+// the file offsets of the canonical blocks.
+using offset_index = flat_index<std::uint64_t>;
+// the running digests of the canonical chain, see basic_storage::chain_digest().
+using chain_index = flat_index<digest>;
+
+/*************************************************************************************************/
+
+#endif // __blockchain__index_hpp
@@ -0,0 +1,438 @@
+
+#ifndef __blockchain__ingest_hpp
+#define __blockchain__ingest_hpp
+
+#include "blockchain.hpp"
+#include "storage.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*************************************************************************************************/
+
+// bounded lock-free queue (D. Vyukov's array based MPMC design).
+// every cell carries a sequence number telling whether it is free for the
+// producer of the given lap or ready for the consumer of it.
+template<typename T>
+struct bounded_queue {
+    // 'capacity' is rounded up to a power of two.
+    explicit bounded_queue(std::size_t capacity)
+        :m_mask{round_up(capacity)-1}
+        ,m_cells(new cell[m_mask+1])
+        ,m_head{0}
+        ,m_tail{0}
+    {
+        for ( std::size_t i = 0; i <= m_mask; ++i ) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    bounded_queue(const bounded_queue &) = delete;
+    bounded_queue& operator= (const bounded_queue &) = delete;
+
+    bool try_push(T &v) {
+        std::size_t pos = m_tail.load(std::memory_order_relaxed);
+        for ( ;; ) {
+            cell &c = m_cells[pos & m_mask];
+            const std::size_t seq = c.seq.load(std::memory_order_acquire);
+            const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if ( diff == 0 ) {
+                if ( m_tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed) ) {
+                    c.value = std::move(v);
+                    c.seq.store(pos+1, std::memory_order_release);
+
+                    return true;
+                }
+            } else if ( diff < 0 ) {
+                return false; // full
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    bool try_pop(T &v) {
+        std::size_t pos = m_head.load(std::memory_order_relaxed);
+        for ( ;; ) {
+            cell &c = m_cells[pos & m_mask];
+            const std::size_t seq = c.seq.load(std::memory_order_acquire);
+            const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos+1);
+            if ( diff == 0 ) {
+                if ( m_head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed) ) {
+                    v = std::move(c.value);
+                    c.seq.store(pos + m_mask + 1, std::memory_order_release);
+
+                    return true;
+                }
+            } else if ( diff < 0 ) {
+                return false; // empty
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    static std::size_t round_up(std::size_t n) {
+        std::size_t r = 2;
+        while ( r < n ) {
+            r <<= 1;
+        }
+
+        return r;
+    }
+
+    struct cell {
+        std::atomic<std::size_t> seq;
+        T value;
+    };
+
+    const std::size_t m_mask;
+    std::unique_ptr<cell[]> m_cells;
+    alignas(64) std::atomic<std::size_t> m_head;
+    alignas(64) std::atomic<std::size_t> m_tail;
+};
+
+namespace detail {
+
+// spins first, then yields, then sleeps, for the stage waiting on an empty or full queue.
+struct backoff {
+    backoff()
+        :m_n{}
+    {}
+
+    void operator()() {
+        if ( m_n < 64 ) {
+            ++m_n;
+        } else if ( m_n < 128 ) {
+            ++m_n;
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+    void reset() { m_n = 0; }
+
+private:
+    std::uint32_t m_n;
+};
+
+} // ns detail
+
+/*************************************************************************************************/
+
+struct ingest_stats {
+    std::uint64_t submitted;
+    std::uint64_t hashed;
+    std::uint64_t sequenced;
+    std::uint64_t written;
+    std::uint64_t bytes;   // payload bytes written
+    double seconds;        // since the pipeline was started
+};
+
+// appends payloads to the canonical tip of a storage through four stages:
+//   producers --> hashers (N threads) --> sequencer --> writer
+// the producers call submit() from any number of threads. the hashers compute
+// the payload digests in parallel. the sequencer restores the submission order,
+// assigns idx, prev hash and timestamp and groups the blocks into batches,
+// the writer appends every batch with a single write.
+// all the queues are bounded, a full queue blocks the stage feeding it. so is the reordering:
+// a submission waits while it's 'queue_size' ahead of the oldest one not sequenced yet.
+//
+// the storage must not be used by anyone else until finish() returns.
+struct ingest_pipeline {
+    enum: std::size_t {
+         default_queue_size = 4096
+        ,batch_blocks       = 1024
+    };
+
+    explicit ingest_pipeline(
+         storage &st
+        ,std::size_t hashers = std::thread::hardware_concurrency()
+        ,std::size_t queue_size = default_queue_size)
+        :m_storage(st)
+        ,m_input{queue_size}
+        ,m_hashed{queue_size}
+        ,m_batches{queue_size / batch_blocks + 2}
+        ,m_window{queue_size ? queue_size : 1}
+        ,m_next_seq{}
+        ,m_sequenced_seq{}
+        ,m_input_closed{}
+        ,m_hashers_alive{}
+        ,m_sequencer_done{}
+        ,m_failed{}
+        ,m_submitted{}
+        ,m_hashed_count{}
+        ,m_sequenced{}
+        ,m_written{}
+        ,m_bytes{}
+        ,m_started{std::chrono::steady_clock::now()}
+        ,m_finished{}
+    {
+        if ( !m_storage.empty() ) {
+            const chain_tip &tip = m_storage.tip();
+            m_next_idx = tip.idx+1;
+            m_prev = tip.sha256;
+        } else {
+            m_next_idx = 0;
+        }
+
+        hashers = hashers ? hashers : 1;
+        m_hashers_alive = hashers;
+        for ( std::size_t i = 0; i < hashers; ++i ) {
+            m_threads.emplace_back([this] { hasher(); });
+        }
+        m_threads.emplace_back([this] { sequencer(); });
+        m_threads.emplace_back([this] { writer(); });
+    }
+    ~ingest_pipeline() {
+        if ( !m_finished ) {
+            try {
+                finish();
+            } catch (...) {}
+        }
+    }
+
+    ingest_pipeline(const ingest_pipeline &) = delete;
+    ingest_pipeline& operator= (const ingest_pipeline &) = delete;
+
+    // thread safe. blocks while the input queue is full.
+    void submit(std::string data) {
+        submit(std::move(data), 0);
+    }
+    // the same, but the block keeps the given timestamp, 0 is for the current time.
+    void submit(std::string data, std::uint64_t timestamp) {
+        push(item{0, std::move(data), std::string(), timestamp, false});
+    }
+    // a block whose payload was pruned, taken by its payload digest.
+    void submit_pruned(std::string sha256, std::uint64_t timestamp) {
+        push(item{0, std::string(), std::move(sha256), timestamp, true});
+    }
+
+    // to be called when all the submit() calls have returned.
+    // waits until everything is written, rethrows the error of a failed stage.
+    void finish() {
+        m_input_closed.store(true, std::memory_order_release);
+        for ( auto &t: m_threads ) {
+            t.join();
+        }
+        m_threads.clear();
+        m_finished = true;
+
+        if ( m_error ) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+    ingest_stats stats() const {
+        return ingest_stats{
+             m_submitted.load(std::memory_order_relaxed)
+            ,m_hashed_count.load(std::memory_order_relaxed)
+            ,m_sequenced.load(std::memory_order_relaxed)
+            ,m_written.load(std::memory_order_relaxed)
+            ,m_bytes.load(std::memory_order_relaxed)
+            ,std::chrono::duration<double>(std::chrono::steady_clock::now() - m_started).count()
+        };
+    }
+
+private:
+    struct item {
+        std::uint64_t seq;
+        std::string data;
+        std::string sha256;
+        std::uint64_t timestamp;
+        bool pruned;
+    };
+    using batch = std::vector<block>;
+
+    void push(item it) {
+        if ( m_failed.load(std::memory_order_relaxed) ) {
+            throw std::runtime_error("ingest pipeline failed");
+        }
+
+        it.seq = m_next_seq.fetch_add(1, std::memory_order_relaxed);
+        detail::backoff wait;
+        // the sequencer holds every item that arrives before its turn, this bounds how many
+        while ( it.seq >= m_sequenced_seq.load(std::memory_order_acquire) + m_window ) {
+            if ( m_failed.load(std::memory_order_relaxed) ) {
+                throw std::runtime_error("ingest pipeline failed");
+            }
+            wait();
+        }
+        while ( !m_input.try_push(it) ) {
+            if ( m_failed.load(std::memory_order_relaxed) ) {
+                throw std::runtime_error("ingest pipeline failed");
+            }
+            wait();
+        }
+        m_submitted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        if ( !m_error ) {
+            m_error = e;
+        }
+        m_failed.store(true, std::memory_order_relaxed);
+    }
+
+    void hasher() {
+        item it;
+        detail::backoff wait;
+        for ( ;; ) {
+            const bool closed = m_input_closed.load(std::memory_order_acquire);
+            if ( !m_input.try_pop(it) ) {
+                if ( closed || m_failed.load(std::memory_order_relaxed) ) {
+                    break;
+                }
+                wait();
+                continue;
+            }
+            wait.reset();
+
+            if ( !it.pruned ) {
+                it.sha256 = sha256_hex(it.data);
+            }
+            m_hashed_count.fetch_add(1, std::memory_order_relaxed);
+            while ( !m_hashed.try_push(it) && !m_failed.load(std::memory_order_relaxed) ) {
+                wait();
+            }
+        }
+        m_hashers_alive.fetch_sub(1, std::memory_order_release);
+    }
+
+    void sequencer() {
+        // the hashers finish out of order, the items wait here for their turn
+        std::map<std::uint64_t, item> pending;
+        std::uint64_t next_seq{};
+        batch out;
+        item it;
+        detail::backoff wait;
+
+        auto flush = [&] {
+            while ( !out.empty() && !m_batches.try_push(out) && !m_failed.load(std::memory_order_relaxed) ) {
+                wait();
+            }
+            out.clear();
+        };
+
+        for ( ;; ) {
+            const bool done = m_hashers_alive.load(std::memory_order_acquire) == 0;
+            bool got = false;
+            while ( out.size() < batch_blocks && m_hashed.try_pop(it) ) {
+                got = true;
+                const std::uint64_t seq = it.seq;
+                pending.emplace(seq, std::move(it));
+
+                for ( auto p = pending.begin(); p != pending.end() && p->first == next_seq; p = pending.erase(p), ++next_seq ) {
+                    block b;
+                    b.idx = m_next_idx++;
+                    b.timestamp = p->second.timestamp ? p->second.timestamp : timestamp();
+                    b.prevsha256 = m_prev;
+                    b.data = std::move(p->second.data);
+                    b.sha256 = std::move(p->second.sha256);
+                    b.pruned = p->second.pruned;
+                    m_prev = b.sha256;
+
+                    out.push_back(std::move(b));
+                    m_sequenced.fetch_add(1, std::memory_order_relaxed);
+                }
+                m_sequenced_seq.store(next_seq, std::memory_order_release);
+            }
+
+            // a batch goes out when it's full or when nothing more is ready right now
+            if ( !out.empty() && (out.size() >= batch_blocks || !got) ) {
+                flush();
+            }
+            if ( m_failed.load(std::memory_order_relaxed) ) {
+                break;
+            }
+            if ( !got ) {
+                if ( done ) {
+                    break;
+                }
+                wait();
+            } else {
+                wait.reset();
+            }
+        }
+        flush();
+        m_sequencer_done.store(true, std::memory_order_release);
+    }
+
+    void writer() {
+        batch b;
+        detail::backoff wait;
+        for ( ;; ) {
+            const bool done = m_sequencer_done.load(std::memory_order_acquire);
+            if ( !m_batches.try_pop(b) ) {
+                if ( done || m_failed.load(std::memory_order_relaxed) ) {
+                    break;
+                }
+                wait();
+                continue;
+            }
+            wait.reset();
+
+            try {
+                storage::add_error ec = m_storage.add(b);
+                if ( ec != storage::add_error::ok ) {
+                    throw std::runtime_error(std::string("ingest: ") + storage::format_error(ec));
+                }
+            } catch (...) {
+                fail(std::current_exception());
+                break;
+            }
+
+            std::uint64_t bytes{};
+            for ( const auto &it: b ) {
+                bytes += it.data.size();
+            }
+            m_written.fetch_add(b.size(), std::memory_order_relaxed);
+            m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    storage &m_storage;
+    bounded_queue<item> m_input;
+    bounded_queue<item> m_hashed;
+    bounded_queue<batch> m_batches;
+
+    const std::uint64_t m_window;
+    std::atomic<std::uint64_t> m_next_seq;
+    // the seq of the oldest item not sequenced yet
+    std::atomic<std::uint64_t> m_sequenced_seq;
+    std::atomic<bool> m_input_closed;
+    std::atomic<std::size_t> m_hashers_alive;
+    std::atomic<bool> m_sequencer_done;
+    std::atomic<bool> m_failed;
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+
+    // the sequencer's state
+    std::uint64_t m_next_idx;
+    std::string m_prev;
+
+    std::atomic<std::uint64_t> m_submitted;
+    std::atomic<std::uint64_t> m_hashed_count;
+    std::atomic<std::uint64_t> m_sequenced;
+    std::atomic<std::uint64_t> m_written;
+    std::atomic<std::uint64_t> m_bytes;
+    const std::chrono::steady_clock::time_point m_started;
+
+    std::vector<std::thread> m_threads;
+    bool m_finished;
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__ingest_hpp
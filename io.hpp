@@ -0,0 +1,55 @@
+
+#ifndef __blockchain__io_hpp
+#define __blockchain__io_hpp
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// pread()/pwrite() of exactly 'n' bytes at 'off', resumed after a signal or a short transfer.
+// false on an error, and for reading also at the end of the file.
+inline
+bool pread_all(int fd, std::uint64_t off, void *dst, std::size_t n) {
+    char *p = static_cast<char *>(dst);
+    while ( n ) {
+        ssize_t rd = ::pread(fd, p, n, off);
+        if ( rd < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( rd <= 0 ) {
+            return false;
+        }
+        p += rd;
+        n -= rd;
+        off += rd;
+    }
+
+    return true;
+}
+
+inline
+bool pwrite_all(int fd, std::uint64_t off, const void *src, std::size_t n) {
+    const char *p = static_cast<const char *>(src);
+    while ( n ) {
+        ssize_t wr = ::pwrite(fd, p, n, off);
+        if ( wr < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( wr <= 0 ) {
+            return false;
+        }
+        p += wr;
+        n -= wr;
+        off += wr;
+    }
+
+    return true;
+}
+
+/*************************************************************************************************/
+
+#endif // __blockchain__io_hpp
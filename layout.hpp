@@ -0,0 +1,331 @@
+
+#ifndef __blockchain__layout_hpp
+#define __blockchain__layout_hpp
+
+#include "blockchain.hpp"
+#include "reader.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/*************************************************************************************************/
+
+// the record layouts basic_storage<> is instantiated with. every layout provides:
+//   payload_type, block_type     - the payload and the block it reads and writes
+//   record_size                  - the size of every record, or 0 when the records vary in size
+//   footer_size                  - the size of the trailing record length, 0 when there is none
+//   encode(buf, b)               - appends the record of 'b' to 'buf'
+//   read(r, end)                 - reads the record at the position of 'r', bounded by 'end'
+//   read_hash(r, end, d)         - skips the record, decoding only its hash
+//   record_start(r, end, start)  - the start of the record ending at 'end', false when it can't be known
+//   drop_payload(b)              - the payload of 'b' as stored by prune()
+//   previous_layout              - the layout of the files written before this one, void when there is none
+//   detect(r, end)               - false when the file at the position of 'r' is of previous_layout
+// a malformed record makes read(), read_hash() and record_start() throw.
+
+[[noreturn]] inline
+void corrupt_record(decode_error ec) {
+    throw std::runtime_error(std::string("corrupt block record: ") + format_error(ec));
+}
+
+/*************************************************************************************************/
+
+// the records of encode_block(). with 'Footer' every record is followed by its
+// uint64_t length, footer included, so the file can be walked from the end too.
+template<bool Footer>
+struct basic_variable_layout {
+    using payload_type = std::string;
+    using block_type = basic_block<payload_type>;
+    using previous_layout = typename std::conditional<Footer, basic_variable_layout<false>, void>::type;
+
+    enum: std::size_t {
+         record_size = 0
+        ,footer_size = Footer ? sizeof(std::uint64_t) : 0
+        // a root with a pruned payload
+        ,min_size    = sizeof(std::uint64_t)*2 + sizeof(std::uint32_t)*2 + block_decoder::trailer_size + footer_size
+    };
+
+    static void encode(std::string &buf, const block_type &b) {
+        const std::size_t pos = buf.size();
+        encode_block(buf, b);
+        if ( Footer ) {
+            const std::uint64_t len = buf.size() - pos + footer_size;
+            buf.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        }
+    }
+
+    static void drop_payload(block_type *b) {
+        b->data.clear();
+        b->data.shrink_to_fit();
+    }
+
+    // false when the hash is malformed.
+    static bool read_hash(file_reader &r, std::uint64_t end, digest *d) {
+        if ( r.tell() >= end ) {
+            corrupt_record(decode_error::truncated);
+        }
+        const std::uint64_t left = end - r.tell();
+
+        std::size_t avail{};
+        const char *p = r.peek(block_decoder::max_header_size, &avail);
+        block_decoder hdr{p, static_cast<std::size_t>(std::min<std::uint64_t>(avail, left))};
+        std::uint32_t size{};
+        decode_error ec = hdr.skip_header(&size);
+        if ( ec != decode_error::ok ) {
+            corrupt_record(ec);
+        }
+
+        const std::uint64_t skip = hdr.used() + (size == pruned_payload_size ? 0 : size);
+        if ( skip + block_decoder::trailer_size > left ) {
+            corrupt_record(decode_error::truncated);
+        }
+        r.skip(skip);
+
+        p = r.peek(block_decoder::trailer_size, &avail);
+        block_decoder trl{p, avail};
+        const char *hex{};
+        if ( (ec = trl.hash(&hex)) != decode_error::ok ) {
+            corrupt_record(ec);
+        }
+        const bool ok = parse_digest(d, hex, block_decoder::hash_size);
+        if ( skip + trl.used() + footer_size > left ) {
+            corrupt_record(decode_error::truncated);
+        }
+        r.skip(trl.used() + footer_size);
+
+        return ok;
+    }
+
+    // the first record is read without its footer: the footer follows it when it holds
+    // the length of the record. a record that can't be read at all is taken as of this layout.
+    static bool detect(file_reader &r, std::uint64_t end) {
+        if ( !Footer ) {
+            return true;
+        }
+
+        const std::uint64_t start = r.tell();
+        try {
+            basic_variable_layout<false>::read(r, end);
+        } catch (const std::runtime_error &) {
+            return true;
+        }
+        std::uint64_t len{};
+        if ( r.tell() + footer_size > end || !r.read(&len, sizeof(len)) ) {
+            return false;
+        }
+
+        return len == r.tell() - start;
+    }
+
+    static bool record_start(file_reader &r, std::uint64_t end, std::uint64_t *start) {
+        if ( !Footer ) {
+            return false;
+        }
+        if ( end < min_size ) {
+            corrupt_record(decode_error::truncated);
+        }
+
+        std::uint64_t len{};
+        r.seek_back(end - footer_size, footer_size);
+        if ( !r.read(&len, sizeof(len)) ) {
+            corrupt_record(decode_error::truncated);
+        }
+        if ( len < min_size || len > end ) {
+            corrupt_record(decode_error::bad_footer);
+        }
+        *start = end - len;
+
+        return true;
+    }
+
+    // the record is decoded in place from the read-ahead window, a record
+    // bigger than the window gets its payload read directly. 'end' bounds the record,
+    // so a corrupt length can't make it allocate more than the file holds.
+    static block_type read(file_reader &r, std::uint64_t end) {
+        if ( r.tell() >= end ) {
+            corrupt_record(decode_error::truncated);
+        }
+        const std::uint64_t start = r.tell();
+        const std::uint64_t left = end - start;
+
+        block_type b;
+        std::size_t avail{};
+        const char *p = r.peek(block_decoder::max_header_size, &avail);
+        avail = std::min<std::uint64_t>(avail, left);
+        block_decoder dec{p, avail};
+        decode_error ec = dec.blk(&b);
+        if ( ec == decode_error::truncated && avail < left ) {
+            // the record runs past the window
+            dec = block_decoder{p, avail};
+            std::uint32_t size{};
+            if ( (ec = dec.header(&b, &size)) != decode_error::ok ) {
+                corrupt_record(ec);
+            }
+            const std::uint64_t need = dec.used()
+                + (size == pruned_payload_size ? 0 : size)
+                + block_decoder::trailer_size
+            ;
+            if ( need > left ) {
+                corrupt_record(decode_error::truncated);
+            }
+
+            if ( need <= r.buffer_size() ) {
+                p = r.peek(need, &avail);
+                dec = block_decoder{p, avail};
+                ec = dec.blk(&b);
+            } else {
+                r.skip(dec.used());
+                b.data.resize(size);
+                if ( !r.read(&b.data[0], size) ) {
+                    corrupt_record(decode_error::truncated);
+                }
+                p = r.peek(block_decoder::trailer_size, &avail);
+                dec = block_decoder{p, avail};
+                ec = dec.hash(&b);
+            }
+        }
+        if ( ec != decode_error::ok ) {
+            corrupt_record(ec);
+        }
+        r.skip(dec.used());
+
+        if ( Footer ) {
+            std::uint64_t len{};
+            if ( r.tell() - start + footer_size > left || !r.read(&len, sizeof(len)) ) {
+                corrupt_record(decode_error::truncated);
+            }
+            if ( len != r.tell() - start ) {
+                corrupt_record(decode_error::bad_footer);
+            }
+        }
+
+        return b;
+    }
+};
+
+using variable_layout = basic_variable_layout<true>;
+// the files written before the records got their footer
+using legacy_layout = basic_variable_layout<false>;
+
+/*************************************************************************************************/
+
+enum: std::uint64_t { fixed_record_pruned = 1 };
+
+// the on-disk record of fixed_layout<N>. no length prefixes: the hashes are
+// always 64 chars (the previous hash of the root is all zeros), the payload always N bytes.
+// trivially copyable, so a run of records is read with a single read into an array of them.
+template<std::size_t N>
+struct fixed_record {
+    std::uint64_t idx;
+    std::uint64_t timestamp;
+    std::uint64_t flags;
+    char prevsha256[block_decoder::hash_size];
+    char sha256[block_decoder::hash_size];
+    char data[N];
+};
+
+// every record takes sizeof(fixed_record<N>) bytes, so the record 'i' of
+// a file holding no side branches is at 'i * record_size'.
+template<std::size_t N>
+struct fixed_layout {
+    using payload_type = std::array<char, N>;
+    using block_type = basic_block<payload_type>;
+    using record_type = fixed_record<N>;
+    using previous_layout = void;
+
+    static_assert(std::is_trivially_copyable<record_type>::value, "fixed_record must be a POD");
+
+    enum: std::size_t {
+         record_size = sizeof(record_type)
+        ,footer_size = 0
+    };
+
+    static void to_record(record_type *rec, const block_type &b) {
+        std::memset(rec, 0, sizeof(*rec));
+        rec->idx = b.idx;
+        rec->timestamp = b.timestamp;
+        rec->flags = b.pruned ? std::uint64_t{fixed_record_pruned} : 0;
+        // both are checked to be 64 chars by storage::add()
+        std::memcpy(rec->prevsha256, b.prevsha256.data(), std::min(b.prevsha256.size(), sizeof(rec->prevsha256)));
+        std::memcpy(rec->sha256, b.sha256.data(), std::min(b.sha256.size(), sizeof(rec->sha256)));
+        if ( !b.pruned ) {
+            std::memcpy(rec->data, b.data.data(), N);
+        }
+    }
+    static block_type to_block(const record_type &rec) {
+        block_type b;
+        b.idx = rec.idx;
+        b.timestamp = rec.timestamp;
+        if ( rec.prevsha256[0] ) {
+            b.prevsha256.assign(rec.prevsha256, sizeof(rec.prevsha256));
+        }
+        std::memcpy(b.data.data(), rec.data, N);
+        b.sha256.assign(rec.sha256, sizeof(rec.sha256));
+        b.pruned = rec.flags & fixed_record_pruned;
+
+        return b;
+    }
+
+    static void encode(std::string &buf, const block_type &b) {
+        const std::size_t pos = buf.size();
+        buf.resize(pos + record_size);
+        record_type rec;
+        to_record(&rec, b);
+        std::memcpy(&buf[pos], &rec, record_size);
+    }
+
+    // the record keeps its size, the payload is zeroed.
+    static void drop_payload(block_type *b) {
+        b->data.fill(0);
+    }
+
+    static bool read_hash(file_reader &r, std::uint64_t end, digest *d) {
+        if ( r.tell() >= end || end - r.tell() < record_size ) {
+            corrupt_record(decode_error::truncated);
+        }
+
+        const std::size_t need = offsetof(record_type, sha256) + block_decoder::hash_size;
+        std::size_t avail{};
+        const char *p = r.peek(need, &avail);
+        if ( avail < need ) {
+            corrupt_record(decode_error::truncated);
+        }
+        const bool ok = parse_digest(d, p + offsetof(record_type, sha256), block_decoder::hash_size);
+        r.skip(record_size);
+
+        return ok;
+    }
+
+    static bool detect(file_reader &, std::uint64_t) {
+        return true;
+    }
+
+    static bool record_start(file_reader &, std::uint64_t end, std::uint64_t *start) {
+        if ( end < record_size ) {
+            corrupt_record(decode_error::truncated);
+        }
+        *start = end - record_size;
+
+        return true;
+    }
+
+    static block_type read(file_reader &r, std::uint64_t end) {
+        record_type rec;
+        if ( r.tell() >= end || end - r.tell() < record_size || !r.read(&rec, record_size) ) {
+            corrupt_record(decode_error::truncated);
+        }
+
+        return to_block(rec);
+    }
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__layout_hpp
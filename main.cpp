@@ -1,10 +1,18 @@
 
 #include "blockchain.hpp"
+#include "import.hpp"
+#include "ingest.hpp"
 #include "storage.hpp"
+#include "sync.hpp"
 
 #include <cstring>
 
 #include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*************************************************************************************************/
 
@@ -14,27 +22,65 @@ void usage(const char *argv0) {
 
     std::cout
     << "usage:" << std::endl
-    << "  " << p << " a|i|h|r" << std::endl
+    << "  " << p << " a|m|f|l|i|h|c|t|s|x|p|r|d|n|w|u" << std::endl
     << "    a \"some string\" - add block" << std::endl
+    << "    m - add a block per line of stdin" << std::endl
+    << "    f <hash> \"some string\" - add block on top of the block with that hash" << std::endl
+    << "    l <file> - add block with the contents of the file as payload, '-' for stdin" << std::endl
     << "    i <idx> - get by idx" << std::endl
     << "    h <hash> - get by block hash" << std::endl
+    << "    c <idx> - write the payload of the block to stdout" << std::endl
+    << "    t - list chain tips" << std::endl
+    << "    s <file> - pull the missing blocks from another blockchain file" << std::endl
+    << "    x <file> [legacy] [raw] - re-chain the canonical chain of another blockchain file on top of this one," << std::endl
+    << "      'legacy' for a file written before the record length footer," << std::endl
+    << "      'raw' to take all the records in the file order up to the first malformed one" << std::endl
+    << "    p <seconds> - prune the payloads of the blocks older than that" << std::endl
     << "    r - recheck blockchain" << std::endl
-    << "    d - dump blockchain" << std::endl;
+    << "    d - dump blockchain" << std::endl
+    << "    n <count> - dump the last blocks of the file, newest first" << std::endl
+    << "    w - print the blocks as they are appended, until interrupted" << std::endl
+    << "    u - upgrade a file written before the record length footer," << std::endl
+    << "      the original is kept as blockchain.dat.legacy" << std::endl;
 }
 
 /*************************************************************************************************/
 
-void add_block(storage &st, const std::string &data) {
+std::string join_args(char **argv, int from) {
+    std::string data;
+    for ( auto i = from; ; ++i ) {
+        const char *p = argv[i];
+        if ( !p ) break;
+
+        if ( i == from ) {
+            data += p;
+        } else {
+            data += " ";
+            data += p;
+        }
+    }
+
+    return data;
+}
+
+storage::add_error
+add_block(storage &st, const std::string &data) {
     block b{};
     if ( st.empty() ) {
         b = new_block("", 0, data.data(), data.size());
-        st.add(b);
     } else {
-        std::uint64_t num{};
-        block last = st.last_block(&num);
-        b = new_block(last.sha256, num, data.data(), data.size());
-        st.add(b);
+        const chain_tip &last = st.tip();
+        b = new_block(last.sha256, last.idx+1, data.data(), data.size());
     }
+
+    return st.add(b);
+}
+
+storage::add_error
+add_block(storage &st, const block &parent, const std::string &data) {
+    block b = new_block(parent.sha256, parent.idx+1, data.data(), data.size());
+
+    return st.add(b);
 }
 
 bool get_by_idx(storage &st, std::uint64_t idx) {
@@ -66,6 +112,16 @@ recheck(std::uint64_t *bad_idx, storage &st) {
     return st.recheck(bad_idx);
 }
 
+void tips(storage &st) {
+    std::vector<block> v = st.tips();
+    for ( auto it = v.begin(); it != v.end(); ++it ) {
+        if ( it != v.begin() ) {
+            std::cout << "/*********************************************************************/" << std::endl;
+        }
+        dump(std::cout, *it);
+    }
+}
+
 void dump(storage &st) {
     if ( !st.empty() ) {
         block b = st.first();
@@ -80,6 +136,44 @@ void dump(storage &st) {
     }
 }
 
+void dump_last(storage &st, std::uint64_t count) {
+    if ( st.empty() || !count ) {
+        return;
+    }
+
+    block b = st.last();
+    dump(std::cout, b);
+    for ( std::uint64_t i = 1; i < count && !st.at_begin(); ++i ) {
+        b = st.prev();
+
+        std::cout << "/*********************************************************************/" << std::endl;
+        dump(std::cout, b);
+    }
+}
+
+void print_stats(const ingest_stats &st) {
+    std::cout
+    << st.written << " blocks in " << st.seconds << "s: "
+    << "read=" << st.submitted / st.seconds << "/s, "
+    << "hashed=" << st.hashed / st.seconds << "/s, "
+    << "written=" << st.written / st.seconds << "/s, "
+    << st.bytes / st.seconds / (1024*1024) << " MB/s"
+    << std::endl;
+}
+
+template<typename Layout>
+ingest_stats import_file(storage &dst, const std::string &fname, bool raw) {
+    if ( raw ) {
+        std::uint64_t end{};
+        ingest_stats st = import_records<Layout>(dst, fname, &end, print_stats);
+        std::cout << "stopped at offset " << end << std::endl;
+
+        return st;
+    }
+
+    return import_chain<Layout>(dst, fname, print_stats);
+}
+
 /*************************************************************************************************/
 
 int main(int argc, char **argv) try {
@@ -89,25 +183,94 @@ int main(int argc, char **argv) try {
         return EXIT_FAILURE;
     }
 
-    storage storage("blockchain.dat");
-
     const char arg = argv[1][0];
+    // the commands that only read neither wait for the writers nor write anything
+    const bool read_only = arg && std::strchr("ihctrdnw", arg);
+    const storage::open_mode mode = read_only
+        ? storage::open_mode::read_only
+        : arg == 'u' ? storage::open_mode::upgrade : storage::open_mode::read_write
+    ;
+    storage storage("blockchain.dat", mode);
+
     switch ( arg ) {
         case 'a': {
-            std::string data;
-            for ( auto i = 2u; ; ++i ) {
-                const char *p = argv[i];
-                if ( !p ) break;
+            std::string data = join_args(argv, 2);
+
+            auto ec = add_block(storage, data);
+            if ( ec != storage::add_error::ok ) {
+                std::cout << "can't add block: " << storage::format_error(ec) << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            break;
+        }
+
+        case 'm': {
+            // otherwise every char of stdin is read under the stdio lock once the stages are running
+            std::ios::sync_with_stdio(false);
+
+            ingest_pipeline pipeline(storage);
+            for ( std::string line; std::getline(std::cin, line); ) {
+                pipeline.submit(std::move(line));
+            }
+            pipeline.finish();
+
+            const ingest_stats st = pipeline.stats();
+            std::cout
+            << st.written << " blocks added in " << st.seconds << "s: "
+            << "hashed=" << st.hashed / st.seconds << "/s, "
+            << "sequenced=" << st.sequenced / st.seconds << "/s, "
+            << "written=" << st.written / st.seconds << "/s, "
+            << st.bytes / st.seconds / (1024*1024) << " MB/s"
+            << std::endl;
+
+            break;
+        }
+
+        case 'f': {
+            bool ok{};
+            block parent = storage.get(&ok, std::string(argv[2]));
+            if ( !ok ) {
+                std::cout << "bad hash!" << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            std::string data = join_args(argv, 3);
+
+            auto ec = add_block(storage, parent, data);
+            if ( ec != storage::add_error::ok ) {
+                std::cout << "can't add block: " << storage::format_error(ec) << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            break;
+        }
+
+        case 'l': {
+            const std::string fname = argv[2];
+            int fd = fname == "-" ? STDIN_FILENO : ::open(fname.c_str(), O_RDONLY);
+            if ( fd == -1 ) {
+                std::cout << "can't open " << fname << std::endl;
+
+                return EXIT_FAILURE;
+            }
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+            block b{};
+            auto ec = storage.add_stream(fd, &b);
+            if ( fd != STDIN_FILENO ) {
+                ::close(fd);
+            }
+            if ( ec != storage::add_error::ok ) {
+                std::cout << "can't add block: " << storage::format_error(ec) << std::endl;
 
-                if ( i == 2 ) {
-                    data += p;
-                } else {
-                    data += " ";
-                    data += p;
-                }
+                return EXIT_FAILURE;
             }
 
-            add_block(storage, data);
+            dump(std::cout, b);
 
             break;
         }
@@ -138,6 +301,87 @@ int main(int argc, char **argv) try {
             break;
         }
 
+        case 'c': {
+            std::uint64_t idx = std::stoul(argv[2]);
+
+            std::cout.flush();
+            if ( !storage.read_payload(idx, STDOUT_FILENO) ) {
+                std::cerr << "bad index or pruned payload!" << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            break;
+        }
+
+        case 't': {
+            tips(storage);
+
+            break;
+        }
+
+        case 's': {
+            ::storage src(argv[2], storage::open_mode::read_only);
+            std::uint64_t received{};
+            auto ec = sync_local(storage, src, &received);
+            if ( ec != sync_error::ok ) {
+                std::cout << "sync failed after " << received << " blocks, with error: " << format_error(ec) << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            std::cout << received << " blocks received" << std::endl;
+
+            break;
+        }
+
+        case 'x': {
+            const std::string fname = argv[2];
+            bool legacy{}, raw{};
+            for ( int i = 3; i < argc; ++i ) {
+                legacy = legacy || argv[i] == std::string("legacy");
+                raw = raw || argv[i] == std::string("raw");
+            }
+
+            struct stat src{}, dst{};
+            if ( ::stat(fname.c_str(), &src) != 0 ) {
+                std::cout << "can't open " << fname << std::endl;
+
+                return EXIT_FAILURE;
+            }
+            if ( ::stat("blockchain.dat", &dst) == 0 && src.st_dev == dst.st_dev && src.st_ino == dst.st_ino ) {
+                std::cout << "can't import a file into itself" << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            std::ios::sync_with_stdio(false);
+            const ingest_stats st = legacy
+                ? import_file<legacy_layout>(storage, fname, raw)
+                : import_file<variable_layout>(storage, fname, raw)
+            ;
+            std::cout << "imported ";
+            print_stats(st);
+
+            break;
+        }
+
+        case 'p': {
+            std::uint64_t age = std::stoull(argv[2]);
+            if ( age > timestamp() / 1000 ) {
+                std::cout << "bad age!" << std::endl;
+
+                return EXIT_FAILURE;
+            }
+
+            storage.prune(timestamp() - age*1000);
+            std::uint64_t reclaimed = storage.prune_finish();
+
+            std::cout << reclaimed << " bytes reclaimed" << std::endl;
+
+            break;
+        }
+
         case 'r': {
             std::uint64_t bad_idx{};
             auto ec = recheck(&bad_idx, storage);
@@ -158,6 +402,32 @@ int main(int argc, char **argv) try {
             break;
         }
 
+        case 'n': {
+            std::uint64_t count = std::stoull(argv[2]);
+
+            dump_last(storage, count);
+
+            break;
+        }
+
+        case 'w': {
+            storage.follow([](const block &b) {
+                dump(std::cout, b);
+                std::cout << "/*********************************************************************/" << std::endl;
+
+                return true;
+            });
+
+            break;
+        }
+
+        case 'u': {
+            // done by the opening
+            std::cout << storage.blocks() << " blocks, blockchain is up to date" << std::endl;
+
+            break;
+        }
+
         default: {
             usage(argv[0]);
 
@@ -0,0 +1,140 @@
+
+#ifndef __blockchain__reader_hpp
+#define __blockchain__reader_hpp
+
+#include "io.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// buffered positional reader over a file descriptor.
+// keeps its own read-ahead window, so seeking inside of the window
+// and reading sequentially never touches the kernel.
+struct file_reader {
+    enum: std::size_t { default_buffer_size = 1024*1024 };
+
+    explicit file_reader(std::size_t bufsize = default_buffer_size)
+        :m_fd{-1}
+        ,m_buf(bufsize)
+        ,m_start{}
+        ,m_avail{}
+        ,m_pos{}
+    {}
+
+    void attach(int fd) {
+        m_fd = fd;
+        invalidate();
+        m_pos = 0;
+    }
+    // drop the read-ahead window, for example after the file was rewritten.
+    void invalidate() {
+        m_start = 0;
+        m_avail = 0;
+    }
+
+    std::uint64_t tell() const { return m_pos; }
+    void seek(std::uint64_t pos) { m_pos = pos; }
+    // seek() for walking the file backwards: when [pos, pos+n) is not in the window,
+    // the refilled window ends with it, so the bytes before 'pos' are read ahead.
+    void seek_back(std::uint64_t pos, std::size_t n) {
+        m_pos = pos;
+        if ( in_window() && m_start + m_avail - m_pos >= n ) {
+            return;
+        }
+
+        const std::uint64_t end = pos + n;
+        m_pos = end > m_buf.size() ? end - m_buf.size() : 0;
+        fill();
+        m_pos = pos;
+    }
+
+    std::size_t buffer_size() const { return m_buf.size(); }
+
+    // the window at the current position, refilled when it holds less than 'n' bytes.
+    // '*avail' can still be less than 'n' at the end of the file or when 'n' exceeds the buffer.
+    const char* peek(std::size_t n, std::size_t *avail) {
+        if ( !in_window() || m_start + m_avail - m_pos < n ) {
+            fill();
+        }
+        *avail = in_window() ? m_start + m_avail - m_pos : 0;
+
+        return m_buf.data() + (m_pos - m_start);
+    }
+
+    bool skip(std::uint64_t n) {
+        m_pos += n;
+
+        return true;
+    }
+
+    bool read(void *dst, std::size_t n) {
+        char *p = static_cast<char *>(dst);
+        while ( n ) {
+            if ( !in_window() ) {
+                // a big read bypasses the window
+                if ( n >= m_buf.size() ) {
+                    return read_direct(p, n);
+                }
+                if ( !fill() ) {
+                    return false;
+                }
+            }
+
+            const std::size_t off = m_pos - m_start;
+            const std::size_t len = std::min<std::uint64_t>(n, m_avail - off);
+            std::memcpy(p, m_buf.data() + off, len);
+            p += len;
+            n -= len;
+            m_pos += len;
+        }
+
+        return true;
+    }
+
+private:
+    bool in_window() const {
+        return m_pos >= m_start && m_pos < m_start + m_avail;
+    }
+    bool fill() {
+        m_start = m_pos;
+        m_avail = 0;
+        for ( ;; ) {
+            ssize_t rd = ::pread(m_fd, m_buf.data(), m_buf.size(), m_start);
+            if ( rd < 0 ) {
+                if ( errno == EINTR ) continue;
+
+                return false;
+            }
+            m_avail = rd;
+
+            return rd > 0;
+        }
+    }
+    bool read_direct(char *p, std::size_t n) {
+        if ( !pread_all(m_fd, m_pos, p, n) ) {
+            return false;
+        }
+        m_pos += n;
+
+        return true;
+    }
+
+private:
+    int m_fd;
+    std::vector<char> m_buf;
+    std::uint64_t m_start;
+    std::uint64_t m_avail;
+    std::uint64_t m_pos;
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__reader_hpp
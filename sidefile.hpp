@@ -0,0 +1,232 @@
+
+#ifndef __blockchain__sidefile_hpp
+#define __blockchain__sidefile_hpp
+
+#include "io.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// FNV-1a, for the checksums of the side files.
+inline
+std::uint64_t fnv1a(const void *p, std::size_t n, std::uint64_t h = 0xcbf29ce484222325ull) {
+    const unsigned char *b = static_cast<const unsigned char *>(p);
+    for ( const unsigned char *e = b + n; b != e; ++b ) {
+        h = (h ^ *b) * 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+// the data file a side file was built for: its size, its inode and a digest of its last
+// 'tail_size' bytes. the size alone is not enough, a file cut and appended back to
+// the same size, or renamed over by a compacted or upgraded copy, has other contents.
+struct data_stamp {
+    enum: std::size_t { tail_size = 64 };
+
+    std::uint64_t covered;
+    std::uint64_t inode;
+    std::uint64_t tail;
+
+    // 'tail' holds the last min(covered, tail_size) bytes of the file.
+    static data_stamp make(std::uint64_t covered, std::uint64_t inode, const char *tail) {
+        const std::size_t n = covered < tail_size ? covered : tail_size;
+
+        return data_stamp{covered, inode, fnv1a(tail, n)};
+    }
+
+    bool operator== (const data_stamp &r) const {
+        return covered == r.covered && inode == r.inode && tail == r.tail;
+    }
+    bool operator!= (const data_stamp &r) const { return !(*this == r); }
+};
+
+/*************************************************************************************************/
+
+// a file kept next to the data file, "<data file>.<ext>", that can always be rebuilt from it:
+// the index, the chain digests, the links, the bloom filters and the tip.
+// 'what' names the file in the errors.
+//
+// 'read_only' is for the readers of a data file being written by another process: the file
+// is never written, a missing one is empty, and the changes a reader makes (rebuilding
+// a stale file for itself) are kept in memory. only the bytes from the lowest offset
+// changed on are copied there, so the appends made in memory copy nothing.
+struct side_file {
+    side_file(const std::string &fname, const char *what, bool read_only = false)
+        :m_fname{fname}
+        ,m_what{what}
+        ,m_read_only{read_only}
+        ,m_fd{-1}
+        ,m_base{}
+    {
+        open();
+    }
+    ~side_file() {
+        ::close(m_fd);
+    }
+    side_file(const side_file &) = delete;
+    side_file& operator= (const side_file &) = delete;
+
+    // the changes made in memory are dropped.
+    void reopen() {
+        ::close(m_fd);
+        m_fd = -1;
+        open();
+    }
+
+    const std::string& fname() const { return m_fname; }
+
+    std::uint64_t size() const {
+        return m_read_only ? m_base + m_mem.size() : size_on_disk();
+    }
+    // the number of whole entries of 'entry_size' after 'header_size' bytes.
+    // a torn trailing entry is dropped.
+    std::uint64_t entries(std::uint64_t header_size, std::uint64_t entry_size) const {
+        const std::uint64_t n = size();
+
+        return n > header_size ? (n - header_size) / entry_size : 0;
+    }
+
+    // false when the file ends before 'off+n'.
+    bool try_read(std::uint64_t off, void *dst, std::size_t n) const {
+        if ( !m_read_only ) {
+            return pread_all(m_fd, off, dst, n);
+        }
+
+        if ( off + n > size() ) {
+            return false;
+        }
+        char *p = static_cast<char *>(dst);
+        const std::size_t disk = off < m_base ? std::min<std::uint64_t>(n, m_base - off) : 0;
+        if ( disk && !pread_all(m_fd, off, p, disk) ) {
+            return false;
+        }
+        if ( n > disk ) {
+            std::memcpy(p + disk, m_mem.data() + (off + disk - m_base), n - disk);
+        }
+
+        return true;
+    }
+    void read(std::uint64_t off, void *dst, std::size_t n) const {
+        if ( !try_read(off, dst, n) ) {
+            fail("can't read");
+        }
+    }
+    void write(std::uint64_t off, const void *src, std::size_t n) {
+        if ( !m_read_only ) {
+            if ( !pwrite_all(m_fd, off, src, n) ) {
+                fail("can't write to");
+            }
+
+            return;
+        }
+
+        if ( off < m_base ) {
+            std::string below(m_base - off, '\0');
+            read(off, &below[0], below.size());
+            m_mem.insert(0, below);
+            m_base = off;
+        }
+        if ( off - m_base + n > m_mem.size() ) {
+            m_mem.resize(off - m_base + n);
+        }
+        std::memcpy(&m_mem[off - m_base], src, n);
+    }
+    void truncate(std::uint64_t size) {
+        if ( !m_read_only ) {
+            if ( ::ftruncate(m_fd, size) != 0 ) {
+                fail("can't truncate");
+            }
+
+            return;
+        }
+
+        if ( size <= m_base ) {
+            m_base = size;
+            m_mem.clear();
+        } else {
+            m_mem.resize(size - m_base);
+        }
+    }
+    void flush() {
+        if ( !m_read_only ) {
+            ::fdatasync(m_fd);
+        }
+    }
+
+    // the header of a file whose entries are appended first and the header rewritten last,
+    // so a torn append leaves the header describing the entries before it.
+    // false when the file is too short to hold one: the header is zeroed, and a zeroed
+    // data_stamp matches no data file, so the file is rebuilt.
+    template<typename Header>
+    bool read_header(Header *hdr) const {
+        if ( !try_read(0, hdr, sizeof(*hdr)) ) {
+            *hdr = Header{};
+
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    void open() {
+        m_base = 0;
+        m_mem.clear();
+        if ( !m_read_only ) {
+            m_fd = ::open(m_fname.c_str(), O_RDWR|O_CREAT, 0644);
+            if ( m_fd == -1 ) {
+                fail("can't open/create");
+            }
+
+            return;
+        }
+
+        m_fd = ::open(m_fname.c_str(), O_RDONLY);
+        if ( m_fd == -1 ) {
+            if ( errno != ENOENT ) {
+                fail("can't open");
+            }
+
+            return;
+        }
+        m_base = size_on_disk();
+    }
+    std::uint64_t size_on_disk() const {
+        struct stat st{};
+        if ( ::fstat(m_fd, &st) != 0 ) {
+            fail("can't stat");
+        }
+
+        return st.st_size;
+    }
+
+    [[noreturn]] void fail(const char *op) const {
+        throw std::runtime_error(std::string(op) + " " + m_what + " file");
+    }
+
+private:
+    std::string m_fname;
+    const char *m_what;
+    bool m_read_only;
+    int m_fd;
+    // with 'm_read_only', the bytes below 'm_base' are read from the file, the rest from 'm_mem'
+    std::uint64_t m_base;
+    std::string m_mem;
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__sidefile_hpp
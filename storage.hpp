@@ -3,125 +3,725 @@
 #define __blockchain__storage_hpp
 
 #include "blockchain.hpp"
+#include "blocktree.hpp"
+#include "bloom.hpp"
+#include "index.hpp"
+#include "io.hpp"
+#include "layout.hpp"
+#include "reader.hpp"
+#include "tip.hpp"
 
+#include <cerrno>
 #include <cstdio>
-#include <cassert>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*************************************************************************************************/
 
-struct storage {
-    explicit storage(const char *fname)
-        :m_file{std::fopen(fname, "a+b")}
+// the chain file of the records of 'Layout' (see layout.hpp), with its index and filters.
+// the layout is fixed at compile time, so are the record reader and writer.
+// any number of processes can use the file at once, the writers are serialised
+// by a lock (see write_lock), the readers open it read-only (see open_mode).
+template<typename Layout>
+struct basic_storage {
+    using layout_type = Layout;
+    using block_type = typename Layout::block_type;
+
+    enum: std::size_t { index_chunk = 4096 };
+
+    enum class open_mode {
+         read_write
+        // for the processes that only read: neither the file nor its side files are ever
+        // written and no lock is taken. the file is read up to the last complete append
+        // the tip cache tells of, so a torn or an unfinished one is never seen. what
+        // has to be rebuilt, because it's stale or missing, is rebuilt in memory only.
+        ,read_only
+        // read_write, and a file of the previous layout is upgraded to this one first
+        // (see upgrade()). without it such a file is refused.
+        ,upgrade
+    };
+
+    explicit basic_storage(const char *fname, open_mode mode = open_mode::read_write)
+        :m_fname{fname}
+        ,m_read_only{mode == open_mode::read_only}
+        ,m_upgrade{mode == open_mode::upgrade}
+        ,m_fd{-1}
+        ,m_lockfd{-1}
+        ,m_locks{}
+        ,m_size{}
+        ,m_ino{}
+        ,m_stamp{}
+        ,m_index{m_fname + ".idx", m_read_only}
+        ,m_chain{m_fname + ".chain", m_read_only}
+        ,m_links{m_fname + ".links", m_read_only}
+        ,m_bloom{m_fname + ".bloom", m_read_only}
+        ,m_tipcache{m_fname + ".tip", m_read_only}
+        ,m_rpos{}
+        ,m_prune_src_size{}
+        ,m_prune_dst_size{}
+        ,m_prune_ino{}
     {
-        if ( !m_file ) {
-            throw std::runtime_error("can't open/create file");
+        if ( !m_read_only ) {
+            m_lockfd = ::open((m_fname + ".lock").c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+            if ( m_lockfd == -1 ) {
+                throw std::runtime_error("can't open/create lock file");
+            }
+        }
+        try {
+            open();
+        } catch (...) {
+            ::close(m_lockfd);
+            ::close(m_fd);
+            throw;
+        }
+    }
+    ~basic_storage() {
+        if ( m_prune_thread.joinable() ) {
+            m_prune_thread.join();
+            ::unlink((m_fname + ".compact").c_str());
         }
+        ::close(m_fd);
+        ::close(m_lockfd);
     }
-    ~storage() {
-        std::fclose(m_file);
+
+    // re-read the file length, for example after the file was appended by another process.
+    void reopen() {
+        ::close(m_fd);
+        m_fd = -1;
+        m_index.reopen();
+        m_chain.reopen();
+        m_links.reopen();
+        m_bloom.reopen();
+        m_tipcache.reopen();
+        open();
     }
 
     bool empty() const {
-        std::uint64_t size = fsize();
-
-        return size == 0;
+        return m_size == 0;
     }
 
     bool at_end() const {
-        std::uint64_t size = fsize();
-        std::uint64_t fpos = std::ftell(m_file);
+        return m_reader.tell() >= m_size;
+    }
+
+    // number of blocks in the canonical chain.
+    std::uint64_t blocks() const {
+        return m_index.size();
+    }
+    // the canonical tip, without reading the block. meaningless when empty().
+    const chain_tip& tip() const {
+        return m_tip;
+    }
+    // the file offset of the canonical block 'idx', which must be less than blocks().
+    std::uint64_t offset_of(std::uint64_t idx) const {
+        return linear() ? idx * Layout::record_size : m_index.at(idx);
+    }
+    // the running digest of the canonical chain up to the block 'idx' (see chain_step()).
+    // unlike the block hash it covers every block below, so equal digests mean equal chains.
+    // computed on demand from the block hashes and kept in a sidecar until a reorg
+    // rewrites the chain under it. 'idx' must be less than blocks().
+    digest chain_digest(std::uint64_t idx) {
+        write_lock lock{*this};
+        if ( idx >= m_chain.size() ) {
+            extend_chain(idx+1);
+        }
 
-        return size == fpos;
+        return m_chain.at(idx);
     }
 
-    std::uint64_t blocks() {
+    block_type last_block(std::uint64_t *n = nullptr) {
+        if ( n ) {
+            *n += m_index.size();
+        }
+
+        return read_at(m_tip.offset);
+    }
+
+    enum class add_error {
+         ok
+        ,bad_root
+        ,bad_idx
+        ,bad_hash
+        ,unknown_parent
+        ,duplicate
+        ,too_large
+    };
+    static const char* format_error(add_error e) {
+        switch ( e ) {
+            case add_error::ok: return "ok";
+            case add_error::bad_root: return "bad root";
+            case add_error::bad_idx: return "bad idx";
+            case add_error::bad_hash: return "bad hash";
+            case add_error::unknown_parent: return "unknown parent";
+            case add_error::duplicate: return "duplicate block";
+            case add_error::too_large: return "payload too large";
+            default: return "NULL";
+        }
+    }
+    // the block can extend any known block, not only the last one.
+    // when the branch it extends becomes the longest, the canonical index
+    // is switched to it, the data file itself is never rewritten.
+    // the parent of a side branch is found through the filters and the persisted links,
+    // the whole file is read only when the links are stale (see link_index).
+    add_error add(const block_type &b) {
+        writable();
+        write_lock lock{*this};
+        digest hash{};
+        if ( !parse_digest(&hash, b.sha256) ) {
+            return add_error::bad_hash;
+        }
+
         if ( empty() ) {
-            return 0;
+            if ( b.idx != 0 || !b.prevsha256.empty() ) {
+                return add_error::bad_root;
+            }
+
+            std::uint64_t off = append(b, hash, link_index::none, link_index::none);
+            m_index.push_back(off);
+            set_tip(off, b.idx, b.sha256);
+
+            return add_error::ok;
         }
 
-        std::uint64_t n{};
-        seek_to_begin();
-        do {
-            read_block();
-            ++n;
-        } while ( !at_end() );
+        if ( b.idx == 0 ) {
+            return add_error::bad_root;
+        }
+        digest prev{};
+        if ( !parse_digest(&prev, b.prevsha256) ) {
+            return add_error::unknown_parent;
+        }
 
-        return n;
+        if ( extends_tip(b, prev) ) {
+            extend_tip(b, hash);
+
+            return add_error::ok;
+        }
+
+        if ( m_links.stamp() != m_stamp ) {
+            rebuild_links();
+        }
+        link_index::link parent{};
+        if ( !find_link(prev, b.idx-1, &parent) ) {
+            return add_error::unknown_parent;
+        }
+
+        return add_child(b, hash, parent, nullptr);
     }
-    block last_block(std::uint64_t *n = nullptr) {
-        seek_to_begin();
+    // the same, but 'b' extends the block at the file offset 'parent' instead of the block
+    // found by the previous hash, which is ambiguous: the hash is the digest of the payload only.
+    // '*off' is the offset of the block, of the one already there for a duplicate.
+    add_error add(const block_type &b, std::uint64_t parent, std::uint64_t *off) {
+        writable();
+        write_lock lock{*this};
+        digest hash{};
+        if ( !parse_digest(&hash, b.sha256) ) {
+            return add_error::bad_hash;
+        }
+        if ( b.idx == 0 ) {
+            return add_error::bad_root;
+        }
+        digest prev{};
+        if ( empty() || !parse_digest(&prev, b.prevsha256) ) {
+            return add_error::unknown_parent;
+        }
 
-        block b;
-        do {
-            b = read_block();
-            if ( n ) {
-                ++(*n);
+        if ( parent == m_tip.offset ) {
+            if ( !extends_tip(b, prev) ) {
+                return add_error::unknown_parent;
             }
-        } while ( !at_end() );
+            *off = extend_tip(b, hash);
 
-        return b;
+            return add_error::ok;
+        }
+
+        if ( m_links.stamp() != m_stamp ) {
+            rebuild_links();
+        }
+        link_index::link p{};
+        digest d{};
+        if ( !m_links.find(parent, &p) || p.height+1 != b.idx ) {
+            return add_error::unknown_parent;
+        }
+        m_reader.seek(parent);
+        if ( !Layout::read_hash(m_reader, m_size, &d) || d != prev ) {
+            return add_error::unknown_parent;
+        }
+
+        return add_child(b, hash, p, off);
     }
 
-    void add(const block &b) {
-        write_block(b);
+    // appends a run of blocks extending the canonical tip with a single write.
+    // nothing is written unless the whole run links up with the tip and within itself.
+    add_error add(const std::vector<block_type> &blocks) {
+        writable();
+        if ( blocks.empty() ) {
+            return add_error::ok;
+        }
+
+        write_lock lock{*this};
+        const bool root = empty();
+        std::uint64_t idx{};
+        digest tip_hash{};
+        if ( !root ) {
+            idx = m_tip.idx+1;
+            parse_digest(&tip_hash, m_tip.sha256);
+        }
+
+        std::vector<digest> hashes(blocks.size());
+        digest prev = tip_hash;
+        for ( std::size_t i = 0; i < blocks.size(); ++i, ++idx ) {
+            const block_type &b = blocks[i];
+            if ( !parse_digest(&hashes[i], b.sha256) ) {
+                return add_error::bad_hash;
+            }
+            if ( b.idx != idx ) {
+                return idx == 0 ? add_error::bad_root : add_error::bad_idx;
+            }
+            if ( idx == 0 ) {
+                if ( !b.prevsha256.empty() ) {
+                    return add_error::bad_root;
+                }
+            } else {
+                digest p{};
+                if ( !parse_digest(&p, b.prevsha256) || p != prev ) {
+                    return add_error::unknown_parent;
+                }
+            }
+            prev = hashes[i];
+        }
+
+        const bool bloom_current = m_bloom.stamp() == m_stamp;
+        const bool links_current = m_links.stamp() == m_stamp;
+
+        std::string buf;
+        std::vector<std::uint64_t> offs(blocks.size());
+        for ( std::size_t i = 0; i < blocks.size(); ++i ) {
+            offs[i] = m_size + buf.size();
+            Layout::encode(buf, blocks[i]);
+        }
+        write_at(m_fd, m_size, buf.data(), buf.size());
+        m_size += buf.size();
+        restamp();
+
+        if ( links_current ) {
+            // the skip ancestors are either in the run or on the canonical chain below it
+            const std::uint64_t first = blocks.front().idx;
+            std::vector<link_index::link> links(blocks.size());
+            for ( std::size_t i = 0; i < blocks.size(); ++i ) {
+                const std::uint64_t h = blocks[i].idx;
+                const std::uint64_t s = block_tree::skip_height(h);
+                links[i].offset = offs[i];
+                links[i].height = h;
+                links[i].parent = i ? offs[i-1] : root ? link_index::none : m_tip.offset;
+                links[i].skip = h == 0 ? link_index::none : s >= first ? offs[s - first] : m_index.at(s);
+            }
+            m_links.append(links.data(), links.size());
+            m_links.commit(m_stamp);
+        }
+        m_index.append(offs.data(), offs.size());
+
+        if ( bloom_current ) {
+            for ( std::size_t i = 0; i < blocks.size(); ++i ) {
+                m_bloom.insert(hashes[i], offs[i]);
+            }
+            m_bloom.commit(m_stamp);
+        }
+        set_tip(offs.back(), blocks.back().idx, blocks.back().sha256);
+
+        return add_error::ok;
     }
 
-    block get(bool *ok, std::uint64_t idx) {
-        block b{};
-        if ( empty() ) {
-            *ok = false;
-            return b;
+    // fills the buffer with the next bytes of a streamed payload, returns 0 at its end.
+    using chunk_reader = std::function<std::size_t(char *, std::size_t)>;
+
+    // appends a block extending the canonical tip whose payload is read from 'read'
+    // chunk by chunk, hashed and written as it comes, so it's never held in memory.
+    // the payload size and the hash are written once the payload has ended.
+    // the payload size is stored in 32 bits: up to 4 GB less two bytes.
+    // on success '*b' holds the block without its payload.
+    add_error add_stream(const chunk_reader &read, block_type *b) {
+        static_assert(Layout::record_size == 0, "the layout has a fixed payload size");
+
+        // held until the record is complete, the other writers append after it
+        writable();
+        write_lock lock{*this};
+        std::uint64_t tip_off = link_index::none;
+        b->idx = 0;
+        b->prevsha256.clear();
+        if ( !empty() ) {
+            tip_off = m_tip.offset;
+            b->idx = m_tip.idx+1;
+            b->prevsha256 = m_tip.sha256;
         }
+        b->timestamp = timestamp();
+        b->data.clear();
+        b->pruned = false;
+
+        const bool bloom_current = m_bloom.stamp() == m_stamp;
+        const bool links_current = m_links.stamp() == m_stamp;
 
-        for ( b = first(); ; b = next() ) {
-            if ( b.idx == idx ) {
-                *ok = true;
-                return b;
+        // the header goes first with a zero payload size, which is patched at the end
+        std::string buf;
+        buf.append(reinterpret_cast<const char *>(&b->idx), sizeof(b->idx));
+        buf.append(reinterpret_cast<const char *>(&b->timestamp), sizeof(b->timestamp));
+        encode_string(buf, b->prevsha256);
+        const std::uint64_t size_pos = m_size + buf.size();
+        buf.append(sizeof(std::uint32_t), '\0');
+
+        std::uint64_t pos = m_size;
+        try {
+            write_at(m_fd, pos, buf.data(), buf.size());
+            pos += buf.size();
+
+            picosha2::hash256_one_by_one hasher;
+            std::vector<char> chunk(file_reader::default_buffer_size);
+            std::uint64_t size{};
+            for ( std::size_t n; (n = read(chunk.data(), chunk.size())) != 0; ) {
+                size += n;
+                if ( size >= pruned_payload_size ) {
+                    cut_partial();
+
+                    return add_error::too_large;
+                }
+                hasher.process(chunk.data(), chunk.data() + n);
+                write_at(m_fd, pos, chunk.data(), n);
+                pos += n;
             }
+            hasher.finish();
+            std::uint8_t hash[picosha2::k_digest_size];
+            hasher.get_hash_bytes(hash, hash + sizeof(hash));
+            b->sha256 = hex_encode(hash, sizeof(hash));
 
-            if ( at_end() ) {
-                break;
+            buf.clear();
+            encode_string(buf, b->sha256);
+            if ( Layout::footer_size != 0 ) {
+                const std::uint64_t len = pos + buf.size() + Layout::footer_size - m_size;
+                buf.append(reinterpret_cast<const char *>(&len), sizeof(len));
             }
+            write_at(m_fd, pos, buf.data(), buf.size());
+            pos += buf.size();
+
+            const std::uint32_t size32 = size;
+            write_at(m_fd, size_pos, reinterpret_cast<const char *>(&size32), sizeof(size32));
+        } catch (...) {
+            cut_partial();
+            throw;
         }
 
-        *ok = false;
+        digest hash{};
+        parse_digest(&hash, b->sha256);
+        const std::uint64_t off = m_size;
+        m_size = pos;
+        restamp();
+        if ( links_current ) {
+            const link_index::link l{off, b->idx, tip_off, b->idx ? canonical_skip(b->idx) : link_index::none};
+            m_links.append(&l, 1);
+            m_links.commit(m_stamp);
+        }
+        m_index.push_back(off);
+        if ( bloom_current ) {
+            m_bloom.insert(hash, off);
+            m_bloom.commit(m_stamp);
+        }
+        set_tip(off, b->idx, b->sha256);
 
-        return b;
+        return add_error::ok;
+    }
+    // the payload is read from 'fd' until its end.
+    add_error add_stream(int fd, block_type *b) {
+        return add_stream(
+            [fd](char *p, std::size_t n) -> std::size_t {
+                for ( ;; ) {
+                    ssize_t rd = ::read(fd, p, n);
+                    if ( rd < 0 && errno == EINTR ) {
+                        continue;
+                    }
+                    if ( rd < 0 ) {
+                        throw std::runtime_error("can't read payload");
+                    }
+
+                    return rd;
+                }
+            }
+            ,b
+        );
     }
-    block get(bool *ok, const std::string &hash) {
-        block b{};
+
+    // all the blocks no other block was appended to. the first one is the canonical tip.
+    // one pass over the links.
+    std::vector<block_type> tips() {
+        write_lock lock{*this};
+        std::vector<block_type> res;
         if ( empty() ) {
+            return res;
+        }
+        if ( m_links.stamp() != m_stamp ) {
+            rebuild_links();
+        }
+
+        std::vector<std::uint64_t> parents;
+        std::vector<link_index::link> links;
+        for ( std::uint64_t i = 0; i < m_links.size(); i += links.size() ) {
+            links.resize(std::min<std::uint64_t>(index_chunk, m_links.size()-i));
+            m_links.read(i, links.data(), links.size());
+            for ( const auto &l: links ) {
+                if ( l.parent != link_index::none ) {
+                    parents.push_back(l.parent);
+                }
+            }
+        }
+        std::sort(parents.begin(), parents.end());
+
+        const std::uint64_t tip_off = m_tip.offset;
+        res.push_back(read_at(tip_off));
+        for ( std::uint64_t i = 0; i < m_links.size(); i += links.size() ) {
+            links.resize(std::min<std::uint64_t>(index_chunk, m_links.size()-i));
+            m_links.read(i, links.data(), links.size());
+            for ( const auto &l: links ) {
+                if ( l.offset != tip_off && !std::binary_search(parents.begin(), parents.end(), l.offset) ) {
+                    res.push_back(read_at(l.offset));
+                }
+            }
+        }
+
+        return res;
+    }
+
+    block_type get(bool *ok, std::uint64_t idx) {
+        block_type b{};
+        if ( idx >= m_index.size() ) {
             *ok = false;
             return b;
         }
 
-        for ( b = first(); ; b = next() ) {
-            if ( b.sha256 == hash ) {
-                *ok = true;
-                return b;
-            }
+        b = read_at(offset_of(idx));
+        *ok = true;
 
-            if ( at_end() ) {
-                break;
+        return b;
+    }
+    // reads up to 'n' canonical records starting with 'idx' straight into 'dst', for the
+    // fixed layouts only. returns the number of records read, less than 'n' at the tip.
+    template<typename Record>
+    std::size_t read(std::uint64_t idx, Record *dst, std::size_t n) {
+        static_assert(
+             std::is_same<Record, typename Layout::record_type>::value
+            ,"the records of the layout are expected"
+        );
+        if ( idx >= m_index.size() ) {
+            return 0;
+        }
+        n = std::min<std::uint64_t>(n, m_index.size() - idx);
+
+        if ( linear() ) {
+            read_at(m_fd, idx * Layout::record_size, dst, n * Layout::record_size);
+
+            return n;
+        }
+
+        std::vector<std::uint64_t> offs;
+        for ( std::size_t i = 0; i < n; i += offs.size() ) {
+            offs.resize(std::min<std::uint64_t>(index_chunk, n-i));
+            m_index.read(idx+i, offs.data(), offs.size());
+            for ( std::size_t j = 0; j < offs.size(); ++j ) {
+                read_at(m_fd, offs[j], &dst[i+j], Layout::record_size);
             }
         }
 
+        return n;
+    }
+    // 'hash' is accepted in any case.
+    block_type get(bool *ok, const std::string &hash) {
+        write_lock lock{*this};
+        block_type b{};
+        digest key{};
         *ok = false;
+        if ( empty() || !parse_digest(&key, hash) ) {
+            return b;
+        }
+
+        // the block itself is read on the first match
+        lookup(key, [this, &b, ok](std::uint64_t off) {
+            b = read_at(off);
+            *ok = true;
+
+            return false;
+        });
 
         return b;
     }
 
-    block first() {
+    block_type first() {
         seek_to_begin();
-        block b = read_block();
+        block_type b = read_block();
+
+        return b;
+    }
+    block_type next() {
+        block_type b = read_block();
 
         return b;
     }
-    block next() {
-        block b = read_block();
+
+    // the same as first()/next() from the end of the file backwards,
+    // over the record lengths. a layout without them can't be walked backwards.
+    block_type last() {
+        m_rpos = m_size;
+
+        return prev();
+    }
+    block_type prev() {
+        std::uint64_t start{};
+        if ( !Layout::record_start(m_reader, m_rpos, &start) ) {
+            throw std::runtime_error("the records of this layout can't be walked backwards");
+        }
+        block_type b = read_at(start);
+        m_rpos = start;
 
         return b;
     }
+    bool at_begin() const {
+        return m_rpos == 0;
+    }
+
+    enum class refresh_result {
+         none
+        ,appended
+        ,replaced   // pruned, the offsets known before are no longer valid
+    };
+    // picks up the blocks another process has appended to the file since it was opened
+    // or refreshed, up to its last complete append: the tip record is written last.
+    refresh_result refresh() {
+        struct stat cur{}, st{};
+        if ( ::stat(m_fname.c_str(), &cur) != 0 ) {
+            return refresh_result::none;
+        }
+        if ( m_fd == -1 || (::fstat(m_fd, &st) == 0 && cur.st_ino != st.st_ino) ) {
+            // created or replaced since
+            const bool created = m_fd == -1;
+            reopen();
+
+            return created ? refresh_result::appended : refresh_result::replaced;
+        }
+
+        std::uint64_t covered{};
+        chain_tip tip;
+        if ( !m_tipcache.latest(&covered, &tip) ) {
+            // a reader may have opened the file before its tip cache was created
+            m_tipcache.reopen();
+            if ( !m_tipcache.latest(&covered, &tip) ) {
+                return refresh_result::none;
+            }
+        }
+        if ( covered <= m_size ) {
+            return refresh_result::none;
+        }
+        reopen();
+
+        return refresh_result::appended;
+    }
+
+    // calls 'fn' with every block appended to the file from now on, by this or
+    // another process, in the file order, until it returns false. the appends are waited
+    // for with inotify on the tip file, or by polling every 'poll_ms' without it.
+    void follow(const std::function<bool(const block_type &)> &fn, int poll_ms = 100) {
+        int ifd = ::inotify_init1(IN_CLOEXEC);
+        if ( ifd != -1 && ::inotify_add_watch(ifd, (m_fname + ".tip").c_str(), IN_MODIFY|IN_ATTRIB) == -1 ) {
+            ::close(ifd);
+            ifd = -1;
+        }
+
+        std::uint64_t pos = m_size;
+        block_type seen{};
+        bool any{};
+        try {
+            for ( ;; ) {
+                if ( refresh() == refresh_result::replaced ) {
+                    // the compaction keeps the records in order, so following resumes after
+                    // the last block seen when it's canonical, otherwise from the new end
+                    pos = m_size;
+                    if ( any && seen.idx < m_index.size() ) {
+                        const block_type b = read_at(offset_of(seen.idx));
+                        if ( b.sha256 == seen.sha256 ) {
+                            pos = m_reader.tell();
+                        }
+                    }
+                }
+                for ( m_reader.seek(pos); pos < m_size; pos = m_reader.tell() ) {
+                    seen = Layout::read(m_reader, m_size);
+                    any = true;
+                    if ( !fn(seen) ) {
+                        ::close(ifd);
+
+                        return;
+                    }
+                }
+
+                if ( ifd == -1 ) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+                    continue;
+                }
+                pollfd pfd{ifd, POLLIN, 0};
+                if ( ::poll(&pfd, 1, poll_ms) > 0 ) {
+                    char events[4096];
+                    while ( ::read(ifd, events, sizeof(events)) > 0 && ::poll(&pfd, 1, 0) > 0 )
+                        ;
+                }
+            }
+        } catch (...) {
+            ::close(ifd);
+            throw;
+        }
+    }
+
+    // writes the payload of the canonical block 'idx' to 'fd' without reading it into memory.
+    // false when there is no such block or its payload was pruned.
+    bool read_payload(std::uint64_t idx, int fd, std::uint64_t *written = nullptr) {
+        static_assert(Layout::record_size == 0, "the layout has a fixed payload size");
+
+        if ( idx >= m_index.size() ) {
+            return false;
+        }
+        const std::uint64_t off = offset_of(idx);
+        m_reader.seek(off);
+
+        std::size_t avail{};
+        const char *p = m_reader.peek(block_decoder::max_header_size, &avail);
+        block_decoder hdr{p, static_cast<std::size_t>(std::min<std::uint64_t>(avail, m_size - off))};
+        std::uint32_t size{};
+        decode_error ec = hdr.skip_header(&size);
+        if ( ec != decode_error::ok ) {
+            corrupt_record(ec);
+        }
+        if ( size == pruned_payload_size ) {
+            return false;
+        }
+        if ( off + hdr.used() + size > m_size ) {
+            corrupt_record(decode_error::truncated);
+        }
+
+        copy_out(m_fd, off + hdr.used(), fd, size);
+        if ( written ) {
+            *written = size;
+        }
+
+        return true;
+    }
 
     enum class recheck_error {
          ok
@@ -140,12 +740,13 @@ struct storage {
             default: return "NULL";
         }
     }
+    // checks the canonical chain.
     recheck_error recheck(std::uint64_t *bad_idx) {
-        if ( empty() ) {
+        if ( m_index.empty() ) {
             return recheck_error::ok;
         }
 
-        block b = first();
+        block_type b = read_at(offset_of(0));
         if ( b.idx != 0 ) {
             *bad_idx = b.idx;
             return recheck_error::bad_root;
@@ -154,7 +755,7 @@ struct storage {
             *bad_idx = b.idx;
             return recheck_error::bad_root;
         }
-        if ( b.sha256 != picosha2::hash256_hex_string(b.data.begin(), b.data.end()) ) {
+        if ( !b.pruned && b.sha256 != sha256_hex(b.data) ) {
             *bad_idx = b.idx;
             return recheck_error::bad_root;
         }
@@ -162,84 +763,965 @@ struct storage {
         std::uint64_t pidx = b.idx;
         std::string phash = b.sha256;
 
-        do {
-            b = next();
-            if ( b.sha256 != picosha2::hash256_hex_string(b.data.begin(), b.data.end()) ) {
-                *bad_idx = b.idx;
-                return recheck_error::bad_hash;
+        std::vector<std::uint64_t> offs;
+        for ( std::uint64_t i = 1; i < m_index.size(); i += offs.size() ) {
+            offs.resize(std::min<std::uint64_t>(index_chunk, m_index.size()-i));
+            m_index.read(i, offs.data(), offs.size());
+
+            for ( std::uint64_t off: offs ) {
+                b = read_at(off);
+                // for a pruned block only the linkage can be checked
+                if ( !b.pruned && b.sha256 != sha256_hex(b.data) ) {
+                    *bad_idx = b.idx;
+                    return recheck_error::bad_hash;
+                }
+                if ( pidx+1 != b.idx ) {
+                    *bad_idx = b.idx;
+                    return recheck_error::bad_idx;
+                }
+                if ( phash != b.prevsha256 ) {
+                    *bad_idx = b.idx;
+                    return recheck_error::bad_prev_hash;
+                }
+
+                pidx = b.idx;
+                phash = b.sha256;
+            }
+        }
+
+        return recheck_error::ok;
+    }
+
+    // drops the payloads of the blocks older than 'before' (ms since epoch) but keeps
+    // their headers and payload digests, so recheck() still verifies the linkage.
+    // the compacted copy is written by a background thread from its own descriptor,
+    // the storage stays usable meanwhile; prune_finish() swaps the copy in.
+    void prune(std::uint64_t before) {
+        writable();
+        if ( m_prune_thread.joinable() ) {
+            throw std::runtime_error("prune is already running");
+        }
+
+        // the copy covers what the writers have completed by now
+        write_lock lock{*this};
+        m_prune_src_size = m_size;
+        m_prune_ino = m_ino;
+        m_prune_dst_size = 0;
+        m_prune_map.clear();
+        m_prune_error = nullptr;
+        m_prune_thread = std::thread([this, before] {
+            try {
+                m_prune_dst_size = compact(m_fname, m_fname + ".compact", m_prune_src_size, before, &m_prune_map);
+            } catch (...) {
+                m_prune_error = std::current_exception();
+            }
+        });
+    }
+    // waits for the background part, copies the blocks appended since prune() was called,
+    // then atomically renames the copy over the file. returns the number of bytes reclaimed.
+    std::uint64_t prune_finish() {
+        if ( !m_prune_thread.joinable() ) {
+            throw std::runtime_error("prune is not running");
+        }
+        m_prune_thread.join();
+
+        const std::string tmp = m_fname + ".compact";
+        if ( m_prune_error ) {
+            ::unlink(tmp.c_str());
+            std::exception_ptr e = m_prune_error;
+            m_prune_error = nullptr;
+            std::rethrow_exception(e);
+        }
+
+        // the blocks appended by the other writers are copied as well,
+        // and none is appended until the copy is renamed over the file
+        write_lock lock{*this};
+        if ( m_ino != m_prune_ino || m_size < m_prune_src_size ) {
+            ::unlink(tmp.c_str());
+            throw std::runtime_error("the file was replaced or cut while pruning");
+        }
+
+        int fd = ::open(tmp.c_str(), O_RDWR);
+        if ( fd == -1 ) {
+            throw std::runtime_error("can't open compacted file");
+        }
+        std::uint64_t dst_off = m_prune_dst_size;
+        std::vector<char> buf(file_reader::default_buffer_size);
+        data_stamp stamp{};
+        try {
+            for ( std::uint64_t off = m_prune_src_size; off < m_size; ) {
+                const std::size_t len = std::min<std::uint64_t>(buf.size(), m_size - off);
+                read_at(m_fd, off, buf.data(), len);
+                write_at(fd, dst_off, buf.data(), len);
+                off += len;
+                dst_off += len;
+            }
+            struct stat st{};
+            if ( ::fstat(fd, &st) != 0 ) {
+                throw std::runtime_error("can't stat compacted file");
+            }
+            stamp = stamp_of(fd, dst_off, st.st_ino);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::fdatasync(fd);
+        ::close(fd);
+
+        // the old offsets grow together with the new ones, so the map is sorted
+        auto remap = [this, &tmp](std::uint64_t off) -> std::uint64_t {
+            if ( off >= m_prune_src_size ) {
+                return off - m_prune_src_size + m_prune_dst_size;
             }
-            if ( pidx+1 != b.idx ) {
-                *bad_idx = b.idx;
-                return recheck_error::bad_idx;
+            auto it = std::lower_bound(
+                 m_prune_map.begin()
+                ,m_prune_map.end()
+                ,std::make_pair(off, std::uint64_t{})
+            );
+            if ( it == m_prune_map.end() || it->first != off ) {
+                ::unlink(tmp.c_str());
+                ::unlink((tmp + ".idx").c_str());
+                throw std::runtime_error("the index refers to a record the compacted file has no copy of");
             }
-            if ( phash != b.prevsha256 ) {
-                *bad_idx = b.idx;
-                return recheck_error::bad_prev_hash;
+
+            return it->second;
+        };
+        {
+            offset_index idx{tmp + ".idx"};
+            idx.truncate(0);
+            std::vector<std::uint64_t> offs;
+            for ( std::uint64_t i = 0; i < m_index.size(); i += offs.size() ) {
+                offs.resize(std::min<std::uint64_t>(index_chunk, m_index.size()-i));
+                m_index.read(i, offs.data(), offs.size());
+                for ( auto &off: offs ) {
+                    off = remap(off);
+                }
+                idx.append(offs.data(), offs.size());
             }
+            idx.flush();
+        }
 
-            pidx = b.idx;
-            phash = b.sha256;
-        } while ( !at_end() );
+        const chain_tip tip{remap(m_tip.offset), m_tip.idx, m_tip.sha256};
+        // the links and the bloom filters refer to the old offsets
+        m_links.clear();
+        m_bloom.clear();
 
-        return recheck_error::ok;
+        // the old index goes first: a crash in between leaves no index, which is rebuilt on open
+        const std::uint64_t old_size = m_size;
+        ::unlink(m_index.fname().c_str());
+        if ( std::rename(tmp.c_str(), m_fname.c_str()) != 0
+            || std::rename((tmp + ".idx").c_str(), m_index.fname().c_str()) != 0 )
+        {
+            throw std::runtime_error("can't replace file with compacted one");
+        }
+        m_prune_map.clear();
+        m_prune_map.shrink_to_fit();
+        m_tipcache.store(stamp, tip);
+
+        reopen();
+
+        return old_size - m_size;
+    }
+
+    // the blocks of a file of this layout read through 'r' in the file order, inserted into 'tree'.
+    // reads nothing but the file, so it's used on files that are not to be opened as a storage.
+    // stops at the first record that can't be read, returns its offset ('size' when there is none).
+    static std::uint64_t scan_tree(file_reader &r, std::uint64_t size, block_tree *tree) {
+        r.seek(0);
+        while ( r.tell() < size ) {
+            const std::uint64_t off = r.tell();
+            block_type b{};
+            try {
+                b = Layout::read(r, size);
+            } catch (const std::runtime_error &) {
+                return off;
+            }
+            digest hash{};
+            if ( !parse_digest(&hash, b.sha256) ) {
+                continue;
+            }
+
+            block_tree::node *parent = nullptr;
+            if ( b.idx == 0 ) {
+                // only the first root is taken
+                if ( !b.prevsha256.empty() || !tree->empty() ) {
+                    continue;
+                }
+            } else {
+                digest prev{};
+                if ( !parse_digest(&prev, b.prevsha256) || !(parent = tree->find(prev, b.idx-1)) ) {
+                    continue;
+                }
+            }
+
+            tree->insert(parent, hash, off);
+        }
+
+        return r.tell();
     }
 
 private:
-    std::uint64_t fsize() const {
-        std::uint64_t ppos = std::ftell(m_file);
-        std::fseek(m_file, 0, SEEK_END);
-        std::uint64_t pos = std::ftell(m_file);
-        std::fseek(m_file, ppos, SEEK_SET);
+    // the writers of the file, in this and in the other processes, are serialised by an exclusive
+    // flock() on "<file>.lock", which unlike the data file is never renamed over. it's held by
+    // everything that writes to the file or to the side files, recursively within the object.
+    // when taken, what the other writers did since it was last held is caught up with.
+    struct write_lock {
+        explicit write_lock(basic_storage &st)
+            :m_st(st)
+        {
+            m_st.lock();
+        }
+        ~write_lock() {
+            m_st.unlock();
+        }
+        write_lock(const write_lock &) = delete;
+        write_lock& operator= (const write_lock &) = delete;
 
-        return pos;
+        basic_storage &m_st;
+    };
+    // the readers need none, see open_mode.
+    void lock() {
+        if ( m_read_only || m_locks++ ) {
+            return;
+        }
+        while ( ::flock(m_lockfd, LOCK_EX) != 0 ) {
+            if ( errno != EINTR ) {
+                --m_locks;
+                throw std::runtime_error("can't lock file");
+            }
+        }
+        try {
+            // not yet open when called from open()
+            if ( m_fd != -1 ) {
+                catch_up();
+            }
+        } catch (...) {
+            unlock();
+            throw;
+        }
     }
-    void seek_to_begin() {
-        std::fseek(m_file, 0, SEEK_SET);
+    void unlock() {
+        if ( !m_read_only && --m_locks == 0 ) {
+            ::flock(m_lockfd, LOCK_UN);
+        }
+    }
+    void writable() const {
+        if ( m_read_only ) {
+            throw std::runtime_error("the storage is open read-only");
+        }
     }
-    void seek_to_end() {
-        std::fseek(m_file, 0, SEEK_END);
+    // every append grows the file, a cut shrinks it and a prune or an upgrade replaces it,
+    // so a size or an inode other than the known ones means another writer was here.
+    void catch_up() {
+        struct stat cur{}, st{};
+        if ( ::stat(m_fname.c_str(), &cur) != 0 || ::fstat(m_fd, &st) != 0 ) {
+            throw std::runtime_error("can't stat file");
+        }
+        if ( cur.st_ino != st.st_ino || static_cast<std::uint64_t>(st.st_size) != m_size ) {
+            reopen();
+        }
     }
 
-    void write_string(const std::string &s) {
-        std::uint32_t size = s.size();
-        assert(std::fwrite(&size, 1, sizeof(size), m_file) == sizeof(size));
-        assert(std::fwrite(s.data(), 1, size, m_file) == size);
+    // copies the first 'size' bytes of 'src' into 'dst', dropping the payloads older than 'before'.
+    // returns the size of 'dst'.
+    static std::uint64_t compact(
+         const std::string &src
+        ,const std::string &dst
+        ,std::uint64_t size
+        ,std::uint64_t before
+        ,std::vector<std::pair<std::uint64_t, std::uint64_t>> *map)
+    {
+        int sfd = ::open(src.c_str(), O_RDONLY);
+        if ( sfd == -1 ) {
+            throw std::runtime_error("can't open file");
+        }
+        int dfd = ::open(dst.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if ( dfd == -1 ) {
+            ::close(sfd);
+            throw std::runtime_error("can't create compacted file");
+        }
+        ::posix_fadvise(sfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        file_reader reader;
+        reader.attach(sfd);
+
+        std::uint64_t written{};
+        std::string buf;
+        try {
+            while ( reader.tell() < size ) {
+                const std::uint64_t off = reader.tell();
+                block_type b = Layout::read(reader, size);
+                if ( !b.pruned && b.timestamp < before ) {
+                    b.pruned = true;
+                    Layout::drop_payload(&b);
+                }
+
+                map->emplace_back(off, written + buf.size());
+                Layout::encode(buf, b);
+                if ( buf.size() >= file_reader::default_buffer_size ) {
+                    write_at(dfd, written, buf.data(), buf.size());
+                    written += buf.size();
+                    buf.clear();
+                }
+            }
+            write_at(dfd, written, buf.data(), buf.size());
+            written += buf.size();
+            ::fdatasync(dfd);
+        } catch (...) {
+            ::close(sfd);
+            ::close(dfd);
+            throw;
+        }
+
+        ::close(sfd);
+        ::close(dfd);
+
+        return written;
     }
-    void write_block(const block &b) {
-        seek_to_end();
 
-        assert(std::fwrite(&b.idx, 1, sizeof(b.idx), m_file) == sizeof(b.idx));
-        assert(std::fwrite(&b.timestamp, 1, sizeof(b.timestamp), m_file) == sizeof(b.timestamp));
-        write_string(b.prevsha256);
-        write_string(b.data);
-        write_string(b.sha256);
+    void open() {
+        // the recovery below writes to the file and to the side files
+        write_lock lock{*this};
+        m_size = 0;
+        m_ino = 0;
+        m_fd = m_read_only ? ::open(m_fname.c_str(), O_RDONLY) : ::open(m_fname.c_str(), O_RDWR|O_CREAT, 0644);
+        if ( m_fd != -1 ) {
+            struct stat st{};
+            if ( ::fstat(m_fd, &st) != 0 ) {
+                throw std::runtime_error("can't stat file");
+            }
+            m_size = st.st_size;
+            m_ino = st.st_ino;
+            ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        } else if ( !m_read_only || errno != ENOENT ) {
+            throw std::runtime_error("can't open/create file");
+        }
+        m_reader.attach(m_fd);
+
+        if ( m_read_only ) {
+            // a writer may be in the middle of an append: the reader stops where the last complete
+            // one ended, and the index entry the unfinished one may have written already is dropped
+            std::uint64_t covered{};
+            chain_tip tip;
+            if ( m_tipcache.latest(&covered, &tip) && covered <= m_size ) {
+                m_size = covered;
+                if ( m_index.size() > tip.idx+1 ) {
+                    m_index.truncate(tip.idx+1);
+                }
+            }
+        }
+        restamp();
+        upgrade(std::integral_constant<bool, !std::is_void<typename Layout::previous_layout>::value>{});
+
+        // the index is missing (a file written before it existed) or does not match the data
+        if ( m_size && (m_index.empty() || m_index.back() >= m_size) ) {
+            rebuild_index();
+        }
+        // the digests are truncated before the index, so they are never longer than it
+        if ( m_chain.size() > m_index.size() ) {
+            m_chain.truncate(0);
+        }
+
+        m_tip = chain_tip{};
+        if ( m_size && !(m_tipcache.load(m_stamp, &m_tip) && m_tip.idx+1 == m_index.size()) ) {
+            recover_tip();
+        }
     }
 
-    std::string read_string() {
-        std::uint32_t size{};
-        assert(std::fread(&size, 1, sizeof(size), m_file) == sizeof(size));
-        std::string s;
-        s.resize(size);
-        assert(std::fread(const_cast<char *>(s.data()), 1, size, m_file) == size);
+    // the tip cache is stale, for example after a crash in the middle of an append.
+    // the records written after the last indexed one are found walking back from the end
+    // of the file over the record lengths, or when that fails (a torn append, or a layout
+    // without the lengths) reading forwards from the last indexed one, cutting a torn tail.
+    // they are indexed when all of them extend the chain, otherwise the index is rebuilt.
+    void recover_tip() {
+        if ( m_index.empty() ) {
+            m_tip = chain_tip{};
+            return;
+        }
+
+        const std::uint64_t last = m_index.back();
+        std::vector<std::uint64_t> tail;
+        bool rebuild = false;
+        if ( !walk_back(last, &tail) ) {
+            tail.clear();
+            const std::uint64_t end = read_forward(last, &tail);
+            if ( end == last ) {
+                // not even the indexed record can be read
+                rebuild = true;
+            } else if ( end < m_size ) {
+                cut_tail(end);
+            }
+        }
+
+        block_type b{};
+        if ( !rebuild ) {
+            b = read_at(last);
+            m_tip = chain_tip{last, b.idx, b.sha256};
+        }
+        for ( auto it = tail.rbegin(); it != tail.rend() && !rebuild; ++it ) {
+            b = read_at(*it);
+            digest prev{}, tip_hash{};
+            if ( b.idx != m_tip.idx+1
+                || !parse_digest(&prev, b.prevsha256)
+                || !parse_digest(&tip_hash, m_tip.sha256)
+                || prev != tip_hash )
+            {
+                rebuild = true;
+                break;
+            }
+            m_index.push_back(*it);
+            m_tip = chain_tip{*it, b.idx, b.sha256};
+        }
+
+        if ( rebuild ) {
+            rebuild_index();
+            if ( m_index.empty() ) {
+                m_tip = chain_tip{};
+                return;
+            }
+            b = read_at(m_index.back());
+            m_tip = chain_tip{m_index.back(), b.idx, b.sha256};
+        }
+        if ( !m_read_only ) {
+            m_tipcache.store(m_stamp, m_tip);
+        }
+    }
+    // the starts of the records after the one at 'last', from the end of the file backwards.
+    // false when the record lengths don't lead back to 'last'.
+    bool walk_back(std::uint64_t last, std::vector<std::uint64_t> *tail) {
+        try {
+            for ( std::uint64_t end = m_size, start{}; end > last; end = start ) {
+                if ( !Layout::record_start(m_reader, end, &start) || start < last ) {
+                    return false;
+                }
+                if ( start > last ) {
+                    tail->push_back(start);
+                }
+            }
+        } catch (const std::runtime_error &) {
+            return false;
+        }
 
-        return s;
+        return true;
     }
-    block read_block() {
-        block b;
+    // the starts of the readable records after the one at 'last', newest first as walk_back() gives them.
+    // returns the end of the last readable record, 'last' when the one at 'last' can't be read.
+    std::uint64_t read_forward(std::uint64_t last, std::vector<std::uint64_t> *tail) {
+        std::uint64_t end = last;
+        try {
+            m_reader.seek(last);
+            read_block();
+            end = m_reader.tell();
+            while ( end < m_size ) {
+                read_block();
+                tail->push_back(end);
+                end = m_reader.tell();
+            }
+        } catch (const std::runtime_error &) {}
+        std::reverse(tail->begin(), tail->end());
 
-        assert(std::fread(&b.idx, 1, sizeof(b.idx), m_file) == sizeof(b.idx));
-        assert(std::fread(&b.timestamp, 1, sizeof(b.timestamp), m_file) == sizeof(b.timestamp));
-        b.prevsha256 = read_string();
-        b.data = read_string();
-        b.sha256 = read_string();
+        return end;
+    }
+    // the bytes from 'end' on are not a record, for example an append torn by a crash.
+    // as the records are contiguous nothing after them can be read, so they are cut
+    // and the appends go after the last readable record again.
+    // the cut bytes are kept in "<file>.torn" until the next cut. the links and the filters
+    // are emptied before the cut: they may cover the cut bytes, and are rebuilt when used.
+    // only a writer holding the lock cuts the file, a reader just stops before the bytes.
+    void cut_tail(std::uint64_t end) {
+        if ( !m_read_only ) {
+            save_torn(end);
+        }
+        m_links.clear();
+        m_bloom.clear();
+        if ( !m_read_only && ::ftruncate(m_fd, end) != 0 ) {
+            throw std::runtime_error("can't truncate file");
+        }
+        m_size = end;
+        m_reader.invalidate();
+        restamp();
 
-        return b;
+        // the offsets grow along the chain, only its top can be in the cut bytes
+        std::uint64_t n = m_index.size();
+        while ( n && m_index.at(n-1) >= end ) {
+            --n;
+        }
+        if ( n < m_index.size() ) {
+            if ( m_chain.size() > n ) {
+                m_chain.truncate(n);
+            }
+            m_index.truncate(n);
+        }
+        if ( m_tip.offset >= end || m_tip.idx >= n ) {
+            m_tip = chain_tip{};
+            if ( n ) {
+                const block_type b = read_at(m_index.back());
+                m_tip = chain_tip{m_index.back(), b.idx, b.sha256};
+            }
+        }
+    }
+
+    void save_torn(std::uint64_t end) {
+        const std::string torn = m_fname + ".torn";
+        int fd = ::open(torn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if ( fd == -1 ) {
+            throw std::runtime_error("can't create torn tail file");
+        }
+        try {
+            copy_out(m_fd, end, fd, m_size - end);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    // a file of the previous layout, one written before the records got their length footer,
+    // is rewritten in the current one on request only: a single pass into "<file>.upgrade"
+    // that is renamed over the file once complete. the original stays as "<file>.legacy",
+    // a hard link made before the rename. the side files are emptied before the rename,
+    // so a crash in between leaves the old file to be upgraded again.
+    void upgrade(std::false_type) {}
+    void upgrade(std::true_type) {
+        using previous = typename Layout::previous_layout;
+
+        m_reader.seek(0);
+        if ( !m_size || Layout::detect(m_reader, m_size) ) {
+            return;
+        }
+        if ( !m_upgrade ) {
+            throw std::runtime_error("the file was written before the record length footer and has to be upgraded");
+        }
+
+        const std::string tmp = m_fname + ".upgrade";
+        int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if ( fd == -1 ) {
+            throw std::runtime_error("can't create upgraded file");
+        }
+        std::uint64_t end{};
+        try {
+            std::string buf;
+            std::uint64_t pos{};
+            m_reader.seek(0);
+            while ( end < m_size ) {
+                block_type b{};
+                try {
+                    b = previous::read(m_reader, m_size);
+                } catch (const std::runtime_error &) {
+                    // a torn tail, see cut_tail()
+                    save_torn(end);
+                    break;
+                }
+                end = m_reader.tell();
+                Layout::encode(buf, b);
+                if ( buf.size() >= file_reader::default_buffer_size ) {
+                    write_at(fd, pos, buf.data(), buf.size());
+                    pos += buf.size();
+                    buf.clear();
+                }
+            }
+            write_at(fd, pos, buf.data(), buf.size());
+            ::fdatasync(fd);
+        } catch (...) {
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            throw;
+        }
+        ::close(fd);
+
+        const std::string legacy = m_fname + ".legacy";
+        ::unlink(legacy.c_str());
+        if ( ::link(m_fname.c_str(), legacy.c_str()) != 0 ) {
+            ::unlink(tmp.c_str());
+            throw std::runtime_error("can't keep the original file");
+        }
+        m_index.truncate(0);
+        m_chain.truncate(0);
+        m_links.clear();
+        m_bloom.clear();
+        if ( std::rename(tmp.c_str(), m_fname.c_str()) != 0 ) {
+            throw std::runtime_error("can't replace file with upgraded one");
+        }
+
+        ::close(m_fd);
+        m_fd = ::open(m_fname.c_str(), O_RDWR);
+        struct stat st{};
+        if ( m_fd == -1 || ::fstat(m_fd, &st) != 0 ) {
+            throw std::runtime_error("can't open upgraded file");
+        }
+        m_size = st.st_size;
+        m_ino = st.st_ino;
+        m_reader.attach(m_fd);
+        restamp();
+    }
+
+    // one pass over the whole file. the links of the tree are persisted,
+    // so the pass is not repeated by the next side branch or the next process.
+    void load_tree(block_tree *tree) {
+        const std::uint64_t end = scan_tree(m_reader, m_size, tree);
+        if ( end < m_size ) {
+            cut_tail(end);
+        }
+
+        m_links.clear();
+        std::vector<link_index::link> links;
+        for ( const block_tree::node &n: tree->nodes() ) {
+            links.push_back(link_index::link{
+                 n.offset
+                ,n.height
+                ,n.parent ? n.parent->offset : link_index::none
+                ,n.skip ? n.skip->offset : link_index::none
+            });
+            if ( links.size() == index_chunk ) {
+                m_links.append(links.data(), links.size());
+                links.clear();
+            }
+        }
+        m_links.append(links.data(), links.size());
+        m_links.commit(m_stamp);
+    }
+    void rebuild_links() {
+        block_tree tree;
+        load_tree(&tree);
+    }
+    void rebuild_index() {
+        block_tree tree;
+        load_tree(&tree);
+
+        m_chain.truncate(0);
+        m_index.truncate(0);
+        block_tree::node *tip = tree.best_tip();
+        if ( tip ) {
+            std::vector<std::uint64_t> offs(tip->height+1);
+            for ( block_tree::node *n = tip; n; n = n->parent ) {
+                offs[n->height] = n->offset;
+            }
+            m_index.append(offs.data(), offs.size());
+        }
+    }
+    // one pass over the whole file, only the hashes are read.
+    void rebuild_bloom() {
+        m_bloom.clear();
+
+        digest d{};
+        m_reader.seek(0);
+        while ( !at_end() ) {
+            const std::uint64_t off = m_reader.tell();
+            // a malformed hash still takes its place in the segment
+            if ( !Layout::read_hash(m_reader, m_size, &d) ) {
+                d = digest{};
+            }
+            m_bloom.insert(d, off);
+        }
+        m_bloom.commit(m_stamp);
+    }
+
+    // only the index entries above the common ancestor are rewritten.
+    void reorg(const link_index::link &from, const link_index::link &to) {
+        link_index::link fork{};
+        if ( !m_links.common_ancestor(from, to, &fork) ) {
+            throw std::runtime_error("broken block links");
+        }
+
+        std::vector<std::uint64_t> offs(to.height - fork.height);
+        for ( link_index::link n = to; n.offset != fork.offset; ) {
+            offs[n.height - fork.height - 1] = n.offset;
+            if ( !m_links.find(n.parent, &n) ) {
+                throw std::runtime_error("broken block links");
+            }
+        }
+
+        if ( m_chain.size() > fork.height+1 ) {
+            m_chain.truncate(fork.height+1);
+        }
+        m_index.truncate(fork.height+1);
+        m_index.append(offs.data(), offs.size());
+    }
+    // computes the running digests of the first 'n' canonical blocks.
+    void extend_chain(std::uint64_t n) {
+        digest below = m_chain.empty() ? digest{} : m_chain.back();
+
+        std::vector<std::uint64_t> offs;
+        std::vector<digest> out;
+        for ( std::uint64_t i = m_chain.size(); i < n; i += offs.size() ) {
+            offs.resize(std::min<std::uint64_t>(index_chunk, n-i));
+            m_index.read(i, offs.data(), offs.size());
+            out.resize(offs.size());
+            for ( std::size_t j = 0; j < offs.size(); ++j ) {
+                m_reader.seek(offs[j]);
+                digest d{};
+                // a malformed hash still takes its place in the chain
+                if ( !Layout::read_hash(m_reader, m_size, &d) ) {
+                    d = digest{};
+                }
+                below = out[j] = chain_step(below, d);
+            }
+            m_chain.append(out.data(), out.size());
+        }
+    }
+
+    bool extends_tip(const block_type &b, const digest &prev) const {
+        digest tip_hash{};
+
+        return b.idx == m_tip.idx+1 && parse_digest(&tip_hash, m_tip.sha256) && prev == tip_hash;
+    }
+    std::uint64_t extend_tip(const block_type &b, const digest &hash) {
+        std::uint64_t off = append(b, hash, m_tip.offset, canonical_skip(b.idx));
+        m_index.push_back(off);
+        set_tip(off, b.idx, b.sha256);
+
+        return off;
+    }
+    // appends 'b' under 'parent', switching the canonical chain to it when it becomes the longest.
+    add_error add_child(const block_type &b, const digest &hash, const link_index::link &parent, std::uint64_t *res) {
+        bool duplicate{};
+        lookup(hash, [this, &b, &parent, res, &duplicate](std::uint64_t off) {
+            link_index::link l{};
+            if ( m_links.find(off, &l) && l.height == b.idx && l.parent == parent.offset ) {
+                duplicate = true;
+                if ( res ) {
+                    *res = off;
+                }
+            }
+
+            return !duplicate;
+        });
+        if ( duplicate ) {
+            return add_error::duplicate;
+        }
+
+        link_index::link tip{}, skip{};
+        if ( !m_links.find(m_tip.offset, &tip)
+            || !m_links.ancestor(parent, block_tree::skip_height(b.idx), &skip) )
+        {
+            throw std::runtime_error("broken block links");
+        }
+
+        std::uint64_t off = append(b, hash, parent.offset, skip.offset);
+        const link_index::link node{off, b.idx, parent.offset, skip.offset};
+        if ( node.height > m_tip.idx ) {
+            reorg(tip, node);
+            set_tip(off, b.idx, b.sha256);
+        } else {
+            // the tip is unchanged, but the file has grown
+            set_tip(m_tip.offset, m_tip.idx, m_tip.sha256);
+        }
+        if ( res ) {
+            *res = off;
+        }
+
+        return add_error::ok;
+    }
+
+    // calls 'fn' with the offset of every record whose hash is 'key', in the file order,
+    // until it returns false. only the hashes of the segments the filter matched are read.
+    template<typename F>
+    void lookup(const digest &key, F fn) {
+        if ( m_bloom.stamp() != m_stamp ) {
+            rebuild_bloom();
+        }
+
+        std::vector<bloom_index::range> ranges;
+        m_bloom.lookup(key, &ranges);
+
+        digest d{};
+        for ( const auto &range: ranges ) {
+            m_reader.seek(range.first);
+            for ( std::uint64_t i = 0; i < range.second && !at_end(); ++i ) {
+                const std::uint64_t off = m_reader.tell();
+                if ( Layout::read_hash(m_reader, m_size, &d) && d == key ) {
+                    const std::uint64_t next = m_reader.tell();
+                    if ( !fn(off) ) {
+                        return;
+                    }
+                    m_reader.seek(next);
+                }
+            }
+        }
+    }
+    // the block 'hash' at 'height', the latest appended one when that's ambiguous too
+    // (see block_tree::find()). false when it's not in the tree.
+    bool find_link(const digest &hash, std::uint64_t height, link_index::link *res) {
+        bool found{};
+        lookup(hash, [this, height, res, &found](std::uint64_t off) {
+            link_index::link l{};
+            if ( m_links.find(off, &l) && l.height == height ) {
+                *res = l;
+                found = true;
+            }
+
+            return true;
+        });
+
+        return found;
+    }
+    // the skip ancestor of the block extending the canonical chain at 'height'.
+    std::uint64_t canonical_skip(std::uint64_t height) const {
+        return m_index.at(block_tree::skip_height(height));
+    }
+
+    // the file holds nothing but the canonical chain, so with a constant
+    // record size the offset of a block follows from its idx alone.
+    bool linear() const {
+        return Layout::record_size != 0 && m_size == m_index.size() * Layout::record_size;
+    }
+    // the stamp the links, the filters and the tip cache are to match, after every change of the file size.
+    void restamp() {
+        m_stamp = stamp_of(m_fd, m_size, m_ino);
+    }
+    static data_stamp stamp_of(int fd, std::uint64_t size, std::uint64_t ino) {
+        char tail[data_stamp::tail_size];
+        const std::uint64_t n = std::min<std::uint64_t>(size, sizeof(tail));
+        read_at(fd, size - n, tail, n);
+
+        return data_stamp::make(size, ino, tail);
+    }
+    void set_tip(std::uint64_t off, std::uint64_t idx, const std::string &hash) {
+        m_tip.offset = off;
+        m_tip.idx = idx;
+        m_tip.sha256 = hash;
+        m_tipcache.store(m_stamp, m_tip);
+    }
+
+    void seek_to_begin() {
+        m_reader.seek(0);
+    }
+
+    // the filters and the links are kept up to date only while they match the file (see data_stamp),
+    // once stale they are rebuilt by the next lookup.
+    std::uint64_t append(const block_type &b, const digest &hash, std::uint64_t parent, std::uint64_t skip) {
+        const bool bloom_current = m_bloom.stamp() == m_stamp;
+        const bool links_current = m_links.stamp() == m_stamp;
+
+        std::uint64_t off = write_block(b);
+        if ( links_current ) {
+            const link_index::link l{off, b.idx, parent, skip};
+            m_links.append(&l, 1);
+            m_links.commit(m_stamp);
+        }
+        if ( bloom_current ) {
+            m_bloom.insert(hash, off);
+            m_bloom.commit(m_stamp);
+        }
+
+        return off;
+    }
+    // drops what an append that failed midway has written after the last record.
+    // when that fails too the bytes are left for the recovery of the next open (see cut_tail()).
+    void cut_partial() {
+        if ( ::ftruncate(m_fd, m_size) != 0 ) {
+            throw std::runtime_error("can't truncate file after a failed append");
+        }
+    }
+    std::uint64_t write_block(const block_type &b) {
+        std::string buf;
+        Layout::encode(buf, b);
+
+        const std::uint64_t off = m_size;
+        write_at(m_fd, off, buf.data(), buf.size());
+        m_size += buf.size();
+        restamp();
+
+        return off;
+    }
+    static void write_at(int fd, std::uint64_t off, const char *p, std::size_t n) {
+        if ( !pwrite_all(fd, off, p, n) ) {
+            throw std::runtime_error("can't write to file");
+        }
+    }
+
+    // the kernel copies the range without it passing through userspace: copy_file_range()
+    // when 'out' is a file, sendfile() otherwise. a bounded buffer when neither is supported.
+    static void copy_out(int in, std::uint64_t off, int out, std::uint64_t n) {
+        loff_t pos = off;
+        while ( n ) {
+            ssize_t wr = ::copy_file_range(in, &pos, out, nullptr, n, 0);
+            if ( wr < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( wr <= 0 ) {
+                break;
+            }
+            n -= wr;
+        }
+        while ( n ) {
+            off_t spos = pos;
+            ssize_t wr = ::sendfile(out, in, &spos, std::min<std::uint64_t>(n, 0x7ffff000));
+            if ( wr < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( wr <= 0 ) {
+                break;
+            }
+            pos = spos;
+            n -= wr;
+        }
+
+        std::vector<char> buf(n ? std::min<std::uint64_t>(n, file_reader::default_buffer_size) : 0);
+        while ( n ) {
+            const std::size_t len = std::min<std::uint64_t>(n, buf.size());
+            read_at(in, pos, buf.data(), len);
+            for ( const char *p = buf.data(), *e = p + len; p != e; ) {
+                ssize_t wr = ::write(out, p, e - p);
+                if ( wr < 0 && errno == EINTR ) {
+                    continue;
+                }
+                if ( wr <= 0 ) {
+                    throw std::runtime_error("can't write payload");
+                }
+                p += wr;
+            }
+            pos += len;
+            n -= len;
+        }
+    }
+
+    static void read_at(int fd, std::uint64_t off, void *dst, std::size_t n) {
+        if ( !pread_all(fd, off, dst, n) ) {
+            throw std::runtime_error("can't read file");
+        }
+    }
+
+    block_type read_at(std::uint64_t off) {
+        m_reader.seek(off);
+
+        return read_block();
+    }
+    block_type read_block() {
+        return Layout::read(m_reader, m_size);
     }
 
 private:
-    std::FILE *m_file;
+    std::string m_fname;
+    const bool m_read_only;
+    const bool m_upgrade;
+    int m_fd;
+    int m_lockfd;
+    unsigned m_locks;
+    std::uint64_t m_size;
+    std::uint64_t m_ino;
+    data_stamp m_stamp;
+    file_reader m_reader;
+    offset_index m_index;
+    chain_index m_chain;
+    link_index m_links;
+    bloom_index m_bloom;
+    tip_cache m_tipcache;
+    chain_tip m_tip;
+    std::uint64_t m_rpos;
+
+    std::thread m_prune_thread;
+    std::exception_ptr m_prune_error;
+    std::uint64_t m_prune_src_size;
+    std::uint64_t m_prune_dst_size;
+    std::uint64_t m_prune_ino;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> m_prune_map;
 };
 
 /*************************************************************************************************/
 
+using storage = basic_storage<variable_layout>;
+
+/*************************************************************************************************/
+
 #endif // __blockchain__storage_hpp
@@ -0,0 +1,565 @@
+
+#include "blockchain.hpp"
+#include "layout.hpp"
+#include "storage.hpp"
+#include "sync.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <array>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// the storage tests, each in a fresh temporary directory.
+//
+// usage: storage_test [fixed_layout|reorg|sync|recovery]
+//   fixed_layout - basic_storage<fixed_layout<N>>: the appends, the reads by idx, by hash
+//                  and in runs of records, a side branch, the backward walk and recheck()
+//   reorg        - a side branch overtaking the canonical chain and being overtaken back
+//   sync         - sync_local() with the local side behind, ahead, diverged or unrelated
+//   recovery     - a torn tail left alone by a reader and cut by a writer, the filters of
+//                  a file cut and appended back to the same size, a footer-less file upgraded
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if ( !(cond) ) { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+/*************************************************************************************************/
+
+void remove_dir(const std::string &dir) {
+    if ( DIR *d = ::opendir(dir.c_str()) ) {
+        while ( dirent *e = ::readdir(d) ) {
+            if ( std::strcmp(e->d_name, ".") && std::strcmp(e->d_name, "..") ) {
+                ::unlink((dir + "/" + e->d_name).c_str());
+            }
+        }
+        ::closedir(d);
+    }
+    ::rmdir(dir.c_str());
+}
+
+// runs 'test' with the name of a data file in a temporary directory removed afterwards.
+template<typename F>
+int in_temp_dir(F test) {
+    char tmpl[] = "/tmp/storage_test.XXXXXX";
+    if ( !::mkdtemp(tmpl) ) {
+        std::cout << "can't create temporary directory" << std::endl;
+
+        return EXIT_FAILURE;
+    }
+    const std::string dir = tmpl;
+
+    try {
+        test(dir + "/blockchain.dat");
+    } catch (...) {
+        remove_dir(dir);
+        throw;
+    }
+    remove_dir(dir);
+
+    std::cout << (failures ? "FAILED" : "passed") << std::endl;
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// 'n' blocks extending 'prev' at 'idx', the payloads tagged with 'tag' so that
+// two branches over the same idx differ.
+template<typename Block>
+std::vector<Block> make_chain(std::string prev, std::uint64_t idx, std::size_t n, char tag) {
+    std::vector<Block> res;
+    for ( std::size_t i = 0; i < n; ++i, ++idx ) {
+        const std::string data = tag + std::to_string(idx);
+        res.push_back(new_block<decltype(Block::data)>(prev, idx, data.data(), data.size()));
+        prev = res.back().sha256;
+    }
+
+    return res;
+}
+
+/*************************************************************************************************/
+
+template<typename Payload>
+bool same_block(const basic_block<Payload> &l, const basic_block<Payload> &r) {
+    return l.idx == r.idx && l.prevsha256 == r.prevsha256 && l.data == r.data && l.sha256 == r.sha256;
+}
+
+// the canonical chain of 'st' is 'chain'.
+template<typename Storage, typename Block>
+bool canonical(Storage &st, const std::vector<Block> &chain) {
+    bool ok = st.blocks() == chain.size();
+    for ( std::size_t i = 0; ok && i < chain.size(); ++i ) {
+        ok = same_block(st.get(&ok, i), chain[i]) && ok;
+    }
+
+    return ok;
+}
+
+/*************************************************************************************************/
+
+using fixed_storage = basic_storage<fixed_layout<32>>;
+using fixed_block = fixed_storage::block_type;
+
+void check_fixed_layout(const std::string &fname) {
+    fixed_storage st{fname.c_str()};
+    CHECK(st.empty());
+
+    // the trunk through add(blocks), one more through add(b)
+    std::vector<fixed_block> trunk = make_chain<fixed_block>(std::string(), 0, 8, 't');
+    CHECK(st.add(trunk) == fixed_storage::add_error::ok);
+    const fixed_block next = make_chain<fixed_block>(trunk.back().sha256, 8, 1, 't').front();
+    CHECK(st.add(next) == fixed_storage::add_error::ok);
+    trunk.push_back(next);
+    CHECK(st.blocks() == trunk.size());
+    CHECK(st.add(next) == fixed_storage::add_error::duplicate);
+
+    bool ok{};
+    for ( const auto &b: trunk ) {
+        CHECK(same_block(st.get(&ok, b.idx), b) && ok);
+        CHECK(same_block(st.get(&ok, b.sha256), b) && ok);
+    }
+    st.get(&ok, trunk.size());
+    CHECK(!ok);
+
+    // the canonical records, with the file still linear and with the index
+    std::vector<fixed_layout<32>::record_type> recs(trunk.size() + 1);
+    CHECK(st.read(2, recs.data(), recs.size()) == trunk.size() - 2);
+    CHECK(recs[0].idx == 2 && std::string(recs[0].sha256, 64) == trunk[2].sha256);
+
+    // a side branch from the block 5 that doesn't overtake the trunk
+    const std::vector<fixed_block> side = make_chain<fixed_block>(trunk[5].sha256, 6, 2, 's');
+    for ( const auto &b: side ) {
+        CHECK(st.add(b) == fixed_storage::add_error::ok);
+    }
+    CHECK(st.blocks() == trunk.size());
+    CHECK(same_block(st.get(&ok, side.back().sha256), side.back()) && ok);
+
+    const std::vector<fixed_block> tips = st.tips();
+    CHECK(tips.size() == 2);
+    CHECK(same_block(tips.at(0), trunk.back()));
+    CHECK(same_block(tips.at(1), side.back()));
+
+    CHECK(st.read(6, recs.data(), recs.size()) == trunk.size() - 6);
+    CHECK(std::string(recs[0].sha256, 64) == trunk[6].sha256);
+
+    // backwards over the file, the side branch was appended last
+    CHECK(same_block(st.last(), side[1]));
+    CHECK(same_block(st.prev(), side[0]));
+    CHECK(same_block(st.prev(), trunk.back()));
+
+    std::uint64_t bad_idx{};
+    CHECK(st.recheck(&bad_idx) == fixed_storage::recheck_error::ok);
+
+    // all of it again from the side files
+    fixed_storage again{fname.c_str()};
+    CHECK(again.blocks() == trunk.size());
+    CHECK(same_block(again.get(&ok, trunk.size()-1), trunk.back()) && ok);
+    CHECK(again.tips().size() == 2);
+    CHECK(again.recheck(&bad_idx) == fixed_storage::recheck_error::ok);
+}
+
+int fixed_layout_test() {
+    return in_temp_dir(check_fixed_layout);
+}
+
+/*************************************************************************************************/
+
+void check_reorg(const std::string &fname) {
+    ::storage st{fname.c_str()};
+    std::vector<block> trunk = make_chain<block>(std::string(), 0, 6, 't');
+    CHECK(st.add(trunk) == ::storage::add_error::ok);
+    const digest fork_digest = st.chain_digest(2);
+    const digest trunk_digest = st.chain_digest(trunk.size()-1);
+
+    // a side branch from the block 2, as long as the trunk and then one longer
+    std::vector<block> side = make_chain<block>(trunk[2].sha256, 3, 4, 's');
+    for ( std::size_t i = 0; i < 3; ++i ) {
+        CHECK(st.add(side[i]) == ::storage::add_error::ok);
+    }
+    CHECK(canonical(st, trunk));
+
+    CHECK(st.add(side[3]) == ::storage::add_error::ok);
+    std::vector<block> chain(trunk.begin(), trunk.begin() + 3);
+    chain.insert(chain.end(), side.begin(), side.end());
+    CHECK(canonical(st, chain));
+    CHECK(same_block(st.last_block(), side.back()));
+    CHECK(st.chain_digest(2) == fork_digest);
+    CHECK(st.chain_digest(trunk.size()-1) != trunk_digest);
+
+    std::vector<block> tips = st.tips();
+    CHECK(tips.size() == 2);
+    CHECK(same_block(tips.at(0), side.back()));
+    CHECK(same_block(tips.at(1), trunk.back()));
+
+    // the blocks left on the old branch are still found by their hash
+    bool ok{};
+    CHECK(same_block(st.get(&ok, trunk[4].sha256), trunk[4]) && ok);
+
+    std::uint64_t bad_idx{};
+    CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+
+    // the same from the side files
+    {
+        ::storage again{fname.c_str()};
+        CHECK(canonical(again, chain));
+        CHECK(again.recheck(&bad_idx) == ::storage::recheck_error::ok);
+    }
+
+    // the old branch grows past the new one and takes the index back
+    const std::vector<block> more = make_chain<block>(trunk.back().sha256, trunk.size(), 2, 't');
+    for ( const auto &b: more ) {
+        CHECK(st.add(b) == ::storage::add_error::ok);
+    }
+    trunk.insert(trunk.end(), more.begin(), more.end());
+    CHECK(canonical(st, trunk));
+    CHECK(st.chain_digest(5) == trunk_digest);
+
+    tips = st.tips();
+    CHECK(tips.size() == 2);
+    CHECK(same_block(tips.at(0), trunk.back()));
+    CHECK(same_block(tips.at(1), side.back()));
+    CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+
+    // the canonical tip extended again through add(blocks)
+    const std::vector<block> run = make_chain<block>(trunk.back().sha256, trunk.size(), 3, 't');
+    CHECK(st.add(run) == ::storage::add_error::ok);
+    trunk.insert(trunk.end(), run.begin(), run.end());
+    CHECK(canonical(st, trunk));
+    CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+}
+
+int reorg_test() {
+    return in_temp_dir(check_reorg);
+}
+
+/*************************************************************************************************/
+
+// 'local' pulled from 'remote', each case in its own pair of files.
+void check_sync(const std::string &fname) {
+    const std::vector<block> trunk = make_chain<block>(std::string(), 0, 10, 't');
+    std::uint64_t received{}, bad_idx{};
+
+    // behind: the missing blocks are appended
+    {
+        ::storage remote{(fname + ".behind.remote").c_str()}, local{(fname + ".behind").c_str()};
+        CHECK(remote.add(trunk) == ::storage::add_error::ok);
+        CHECK(local.add(std::vector<block>(trunk.begin(), trunk.begin() + 4)) == ::storage::add_error::ok);
+
+        CHECK(sync_local(local, remote, &received) == sync_error::ok);
+        CHECK(received == trunk.size() - 4);
+        CHECK(canonical(local, trunk));
+        CHECK(local.chain_digest(trunk.size()-1) == remote.chain_digest(trunk.size()-1));
+        CHECK(local.recheck(&bad_idx) == ::storage::recheck_error::ok);
+
+        // and nothing more the second time
+        CHECK(sync_local(local, remote, &received) == sync_error::ok);
+        CHECK(received == 0);
+        CHECK(canonical(local, trunk));
+    }
+
+    // empty: the whole chain
+    {
+        ::storage remote{(fname + ".empty.remote").c_str()}, local{(fname + ".empty").c_str()};
+        CHECK(remote.add(trunk) == ::storage::add_error::ok);
+
+        CHECK(sync_local(local, remote, &received) == sync_error::ok);
+        CHECK(received == trunk.size());
+        CHECK(canonical(local, trunk));
+    }
+
+    // ahead: the remote chain is a prefix of the local one, nothing changes
+    {
+        ::storage remote{(fname + ".ahead.remote").c_str()}, local{(fname + ".ahead").c_str()};
+        CHECK(remote.add(std::vector<block>(trunk.begin(), trunk.begin() + 6)) == ::storage::add_error::ok);
+        CHECK(local.add(trunk) == ::storage::add_error::ok);
+
+        CHECK(sync_local(local, remote, &received) == sync_error::ok);
+        CHECK(received == 0);
+        CHECK(canonical(local, trunk));
+        CHECK(local.tips().size() == 1);
+    }
+
+    // diverged, the remote branch longer: it's added and becomes the canonical one
+    {
+        ::storage remote{(fname + ".longer.remote").c_str()}, local{(fname + ".longer").c_str()};
+        std::vector<block> rchain(trunk.begin(), trunk.begin() + 5);
+        const std::vector<block> rside = make_chain<block>(rchain.back().sha256, 5, 7, 'r');
+        rchain.insert(rchain.end(), rside.begin(), rside.end());
+        std::vector<block> lchain(trunk.begin(), trunk.begin() + 5);
+        const std::vector<block> lside = make_chain<block>(lchain.back().sha256, 5, 3, 'l');
+        lchain.insert(lchain.end(), lside.begin(), lside.end());
+        CHECK(remote.add(rchain) == ::storage::add_error::ok);
+        CHECK(local.add(lchain) == ::storage::add_error::ok);
+
+        CHECK(sync_local(local, remote, &received) == sync_error::ok);
+        CHECK(received == rside.size());
+        CHECK(canonical(local, rchain));
+        CHECK(local.chain_digest(rchain.size()-1) == remote.chain_digest(rchain.size()-1));
+        const std::vector<block> tips = local.tips();
+        CHECK(tips.size() == 2);
+        CHECK(same_block(tips.at(0), rchain.back()));
+        CHECK(same_block(tips.at(1), lchain.back()));
+        CHECK(local.recheck(&bad_idx) == ::storage::recheck_error::ok);
+    }
+
+    // diverged, the local branch longer: the remote one is kept as a side branch
+    {
+        ::storage remote{(fname + ".shorter.remote").c_str()}, local{(fname + ".shorter").c_str()};
+        std::vector<block> rchain(trunk.begin(), trunk.begin() + 5);
+        const std::vector<block> rside = make_chain<block>(rchain.back().sha256, 5, 2, 'r');
+        rchain.insert(rchain.end(), rside.begin(), rside.end());
+        std::vector<block> lchain(trunk.begin(), trunk.begin() + 5);
+        const std::vector<block> lside = make_chain<block>(lchain.back().sha256, 5, 4, 'l');
+        lchain.insert(lchain.end(), lside.begin(), lside.end());
+        CHECK(remote.add(rchain) == ::storage::add_error::ok);
+        CHECK(local.add(lchain) == ::storage::add_error::ok);
+
+        CHECK(sync_local(local, remote, &received) == sync_error::ok);
+        CHECK(received == rside.size());
+        CHECK(canonical(local, lchain));
+        bool ok{};
+        CHECK(same_block(local.get(&ok, rchain.back().sha256), rchain.back()) && ok);
+        CHECK(local.tips().size() == 2);
+    }
+
+    // unrelated: different roots are refused
+    {
+        ::storage remote{(fname + ".other.remote").c_str()}, local{(fname + ".other").c_str()};
+        CHECK(remote.add(trunk) == ::storage::add_error::ok);
+        CHECK(local.add(make_chain<block>(std::string(), 0, 3, 'o')) == ::storage::add_error::ok);
+
+        CHECK(sync_local(local, remote, &received) == sync_error::rejected);
+        CHECK(received == 0);
+        CHECK(local.blocks() == 3);
+    }
+}
+
+int sync_test() {
+    return in_temp_dir(check_sync);
+}
+
+/*************************************************************************************************/
+
+// the contents of the file, empty when there is none.
+std::string read_file(const std::string &fname) {
+    std::string res;
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if ( fd == -1 ) {
+        return res;
+    }
+    struct stat st{};
+    if ( ::fstat(fd, &st) == 0 ) {
+        res.resize(st.st_size);
+        if ( !pread_all(fd, 0, &res[0], res.size()) ) {
+            res.clear();
+        }
+    }
+    ::close(fd);
+
+    return res;
+}
+
+void write_file(const std::string &fname, std::uint64_t off, const std::string &buf) {
+    int fd = ::open(fname.c_str(), O_WRONLY|O_CREAT, 0644);
+    const bool ok = fd != -1 && pwrite_all(fd, off, buf.data(), buf.size());
+    ::close(fd);
+    if ( !ok ) {
+        throw std::runtime_error("can't write " + fname);
+    }
+}
+
+// the names and the contents of the files in the directory of 'fname'.
+std::map<std::string, std::string> dir_contents(const std::string &fname) {
+    const std::string dir = fname.substr(0, fname.rfind('/'));
+    std::map<std::string, std::string> res;
+    if ( DIR *d = ::opendir(dir.c_str()) ) {
+        while ( dirent *e = ::readdir(d) ) {
+            if ( std::strcmp(e->d_name, ".") && std::strcmp(e->d_name, "..") ) {
+                res[e->d_name] = read_file(dir + "/" + e->d_name);
+            }
+        }
+        ::closedir(d);
+    }
+
+    return res;
+}
+
+// a crash in the middle of an append: half of the next record at the end of the file.
+void check_torn_tail(const std::string &fname) {
+    std::vector<block> trunk = make_chain<block>(std::string(), 0, 6, 't');
+    const block next = make_chain<block>(trunk.back().sha256, trunk.size(), 1, 't').front();
+    {
+        ::storage st{fname.c_str()};
+        CHECK(st.add(trunk) == ::storage::add_error::ok);
+    }
+    const std::string data = read_file(fname);
+    std::string torn;
+    variable_layout::encode(torn, next);
+    torn.resize(torn.size() / 2);
+    write_file(fname, data.size(), torn);
+
+    // a reader sees the complete appends only and writes nothing, with the tip cache
+    // and without it, when the tail is found reading forwards
+    std::uint64_t bad_idx{};
+    for ( int pass = 0; pass < 2; ++pass ) {
+        if ( pass ) {
+            ::unlink((fname + ".tip").c_str());
+        }
+        const std::map<std::string, std::string> before = dir_contents(fname);
+        {
+            ::storage st{fname.c_str(), ::storage::open_mode::read_only};
+            CHECK(canonical(st, trunk));
+            CHECK(st.tip().sha256 == trunk.back().sha256);
+            CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+            CHECK(st.tips().size() == 1);
+            bool ok{};
+            CHECK(same_block(st.get(&ok, trunk.back().sha256), trunk.back()) && ok);
+            bool refused{};
+            try {
+                st.add(next);
+            } catch (const std::runtime_error &) {
+                refused = true;
+            }
+            CHECK(refused);
+        }
+        CHECK(dir_contents(fname) == before);
+    }
+
+    // a writer cuts the tail, keeping it aside
+    {
+        ::storage st{fname.c_str()};
+        CHECK(read_file(fname) == data);
+        CHECK(read_file(fname + ".torn") == torn);
+        CHECK(canonical(st, trunk));
+        CHECK(st.add(next) == ::storage::add_error::ok);
+        trunk.push_back(next);
+        CHECK(canonical(st, trunk));
+        CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+    }
+    ::storage st{fname.c_str()};
+    CHECK(canonical(st, trunk));
+}
+
+// the last block replaced by another of the same size: the side files covering
+// the old one (the filters, the links, the tip) must not be taken for the new one.
+void check_same_size(const std::string &fname) {
+    std::vector<block> trunk = make_chain<block>(std::string(), 0, 6, 't');
+    std::uint64_t off{};
+    {
+        ::storage st{fname.c_str()};
+        CHECK(st.add(trunk) == ::storage::add_error::ok);
+        off = st.offset_of(trunk.size()-1);
+        // the filters and the links are written
+        bool ok{};
+        CHECK(st.get(&ok, trunk.back().sha256).idx == trunk.back().idx && ok);
+        CHECK(st.tips().size() == 1);
+    }
+    const std::uint64_t size = read_file(fname).size();
+
+    const block old = trunk.back();
+    trunk.back() = make_chain<block>(trunk[trunk.size()-2].sha256, trunk.size()-1, 1, 'x').front();
+    std::string rec;
+    variable_layout::encode(rec, trunk.back());
+    CHECK(off + rec.size() == size);
+    CHECK(::truncate(fname.c_str(), off) == 0);
+    write_file(fname, off, rec);
+
+    ::storage st{fname.c_str()};
+    CHECK(canonical(st, trunk));
+    CHECK(st.tip().sha256 == trunk.back().sha256);
+    bool ok{};
+    CHECK(same_block(st.get(&ok, trunk.back().sha256), trunk.back()) && ok);
+    st.get(&ok, old.sha256);
+    CHECK(!ok);
+    const std::vector<block> tips = st.tips();
+    CHECK(tips.size() == 1);
+    CHECK(same_block(tips.at(0), trunk.back()));
+    std::uint64_t bad_idx{};
+    CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+}
+
+// a file written before the record length footer: refused, then upgraded on request.
+void check_legacy(const std::string &fname) {
+    const std::vector<block> trunk = make_chain<block>(std::string(), 0, 6, 't');
+    std::string data;
+    for ( const auto &b: trunk ) {
+        legacy_layout::encode(data, b);
+    }
+    write_file(fname, 0, data);
+
+    bool refused{};
+    try {
+        ::storage st{fname.c_str()};
+    } catch (const std::runtime_error &) {
+        refused = true;
+    }
+    CHECK(refused);
+    CHECK(read_file(fname) == data);
+
+    {
+        ::storage st{fname.c_str(), ::storage::open_mode::upgrade};
+        CHECK(canonical(st, trunk));
+        std::uint64_t bad_idx{};
+        CHECK(st.recheck(&bad_idx) == ::storage::recheck_error::ok);
+    }
+    CHECK(read_file(fname + ".legacy") == data);
+    CHECK(read_file(fname) != data);
+
+    ::storage st{fname.c_str()};
+    CHECK(canonical(st, trunk));
+    CHECK(st.last().sha256 == trunk.back().sha256);
+}
+
+void check_recovery(const std::string &fname) {
+    check_torn_tail(fname + ".torn_tail");
+    check_same_size(fname + ".same_size");
+    check_legacy(fname + ".legacy");
+}
+
+int recovery_test() {
+    return in_temp_dir(check_recovery);
+}
+
+/*************************************************************************************************/
+
+int main(int argc, char **argv) try {
+    const std::string mode = argc > 1 ? argv[1] : "fixed_layout";
+    if ( mode == "fixed_layout" ) {
+        return fixed_layout_test();
+    }
+    if ( mode == "reorg" ) {
+        return reorg_test();
+    }
+    if ( mode == "sync" ) {
+        return sync_test();
+    }
+    if ( mode == "recovery" ) {
+        return recovery_test();
+    }
+
+    std::cout << "usage: " << argv[0] << " [fixed_layout|reorg|sync|recovery]" << std::endl;
+
+    return EXIT_FAILURE;
+} catch (const std::exception &ex) {
+    std::cout << "std::exception: " << ex.what() << std::endl;
+    return EXIT_FAILURE;
+}
+
+/*************************************************************************************************/
@@ -0,0 +1,435 @@
+
+#ifndef __blockchain__sync_hpp
+#define __blockchain__sync_hpp
+
+#include "blockchain.hpp"
+#include "storage.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*************************************************************************************************/
+
+// chain synchronisation between two storages over a stream file descriptor
+// (a socket, a pair of pipes, or a socketpair for the in-process case).
+//
+// the pulling side asks for the remote tip, finds the last common block by
+// a binary search over the running chain digests (see basic_storage::chain_digest()),
+// then requests the missing blocks in batches and verifies every batch while appending it.
+// the block hashes can't be searched: they are the digests of the payloads only,
+// so equal hashes at some idx say nothing about the blocks below it.
+//
+// every message is: uint8_t type, uint32_t payload size, payload.
+
+enum class sync_msg: std::uint8_t {
+     tip         // -> u64 nblocks, str chain digest of the last block
+    ,hash        // u64 idx -> u8 found, str chain digest
+    ,blocks      // u64 from idx, u32 max blocks -> u32 n, n encoded blocks
+    ,done
+};
+
+struct sync_channel {
+    enum: std::size_t { recv_chunk = 1024*1024 };
+
+    explicit sync_channel(int fd)
+        :m_fd{fd}
+    {}
+
+    bool send(sync_msg type, const std::string &payload) {
+        char hdr[1 + sizeof(std::uint32_t)];
+        hdr[0] = static_cast<char>(type);
+        std::uint32_t size = payload.size();
+        std::memcpy(hdr+1, &size, sizeof(size));
+
+        return write_all(hdr, sizeof(hdr)) && write_all(payload.data(), payload.size());
+    }
+    bool recv(sync_msg *type, std::string *payload) {
+        char hdr[1 + sizeof(std::uint32_t)];
+        if ( !read_all(hdr, sizeof(hdr)) ) {
+            return false;
+        }
+        *type = static_cast<sync_msg>(hdr[0]);
+        std::uint32_t size{};
+        std::memcpy(&size, hdr+1, sizeof(size));
+
+        // the size is the peer's word, the buffer grows with what was actually received
+        payload->clear();
+        for ( std::size_t got = 0; got < size; ) {
+            const std::size_t n = std::min<std::size_t>(size - got, recv_chunk);
+            payload->resize(got + n);
+            if ( !read_all(&(*payload)[got], n) ) {
+                return false;
+            }
+            got += n;
+        }
+
+        return true;
+    }
+
+private:
+    bool write_all(const char *p, std::size_t n) {
+        while ( n ) {
+            ssize_t wr = ::write(m_fd, p, n);
+            if ( wr < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( wr <= 0 ) {
+                return false;
+            }
+            p += wr;
+            n -= wr;
+        }
+
+        return true;
+    }
+    bool read_all(char *p, std::size_t n) {
+        while ( n ) {
+            ssize_t rd = ::read(m_fd, p, n);
+            if ( rd < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( rd <= 0 ) {
+                return false;
+            }
+            p += rd;
+            n -= rd;
+        }
+
+        return true;
+    }
+
+private:
+    int m_fd;
+};
+
+/*************************************************************************************************/
+
+namespace detail {
+
+inline
+void put_u64(std::string &buf, std::uint64_t v) {
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+inline
+void put_u32(std::string &buf, std::uint32_t v) {
+    buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+// the chain digest of the block 'idx' as sent on the wire, empty when there is no such block.
+inline
+std::string chain_digest(storage &st, std::uint64_t idx) {
+    if ( idx >= st.blocks() ) {
+        return std::string();
+    }
+    const digest d = st.chain_digest(idx);
+
+    return std::string(reinterpret_cast<const char *>(d.w), sizeof(d.w));
+}
+
+} // ns detail
+
+/*************************************************************************************************/
+
+enum: std::size_t {
+     sync_batch_blocks = 4096
+    ,sync_batch_bytes  = 4*1024*1024
+};
+
+// answers the requests until 'done' or until the other side goes away.
+inline
+bool sync_serve(storage &st, int fd) {
+    sync_channel ch{fd};
+    sync_msg type{};
+    std::string in, out;
+    while ( ch.recv(&type, &in) ) {
+        block_decoder parser{in};
+        out.clear();
+
+        switch ( type ) {
+            case sync_msg::tip: {
+                detail::put_u64(out, st.blocks());
+                encode_string(out, st.blocks() ? detail::chain_digest(st, st.blocks()-1) : std::string());
+
+                break;
+            }
+            case sync_msg::hash: {
+                std::uint64_t idx{};
+                if ( !parser.pod(&idx) ) {
+                    return false;
+                }
+
+                const std::string d = detail::chain_digest(st, idx);
+                out.push_back(d.empty() ? 0 : 1);
+                encode_string(out, d);
+
+                break;
+            }
+            case sync_msg::blocks: {
+                std::uint64_t from{};
+                std::uint32_t max{};
+                if ( !parser.pod(&from) || !parser.pod(&max) ) {
+                    return false;
+                }
+
+                std::string blocks;
+                std::uint32_t n{};
+                for ( ; n < max && n < sync_batch_blocks && blocks.size() < sync_batch_bytes; ++n ) {
+                    bool ok{};
+                    block b = st.get(&ok, from+n);
+                    if ( !ok ) {
+                        break;
+                    }
+                    encode_block(blocks, b);
+                }
+                detail::put_u32(out, n);
+                out += blocks;
+
+                break;
+            }
+            case sync_msg::done: {
+                return true;
+            }
+            default: {
+                return false;
+            }
+        }
+
+        if ( !ch.send(type, out) ) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+/*************************************************************************************************/
+
+enum class sync_error {
+     ok
+    ,io
+    ,protocol
+    ,bad_hash
+    ,bad_idx
+    ,bad_prev_hash
+    ,rejected
+};
+
+inline
+const char* format_error(sync_error e) {
+    switch ( e ) {
+        case sync_error::ok: return "ok";
+        case sync_error::io: return "i/o error";
+        case sync_error::protocol: return "protocol error";
+        case sync_error::bad_hash: return "bad hash";
+        case sync_error::bad_idx: return "bad idx";
+        case sync_error::bad_prev_hash: return "bad previous hash";
+        case sync_error::rejected: return "rejected by storage";
+        default: return "NULL";
+    }
+}
+
+namespace detail {
+
+inline
+sync_error request(sync_channel &ch, sync_msg type, const std::string &out, std::string *in) {
+    sync_msg rtype{};
+    if ( !ch.send(type, out) || !ch.recv(&rtype, in) ) {
+        return sync_error::io;
+    }
+
+    return rtype == type ? sync_error::ok : sync_error::protocol;
+}
+
+inline
+sync_error remote_digest(sync_channel &ch, std::uint64_t idx, std::string *res) {
+    std::string out, in;
+    put_u64(out, idx);
+    sync_error ec = request(ch, sync_msg::hash, out, &in);
+    if ( ec != sync_error::ok ) {
+        return ec;
+    }
+
+    block_decoder parser{in};
+    std::uint8_t found{};
+    if ( !parser.pod(&found) || !parser.str(res) || !found ) {
+        return sync_error::protocol;
+    }
+
+    return sync_error::ok;
+}
+
+inline
+std::string local_hash(storage &st, std::uint64_t idx) {
+    bool ok{};
+    return st.get(&ok, idx).sha256;
+}
+
+} // ns detail
+
+// pulls into 'st' the blocks it is missing. '*received' is the number of appended blocks.
+inline
+sync_error sync_pull(storage &st, int fd, std::uint64_t *received = nullptr) {
+    sync_channel ch{fd};
+    std::string out, in;
+    sync_error ec{};
+
+    if ( received ) {
+        *received = 0;
+    }
+
+    if ( (ec = detail::request(ch, sync_msg::tip, out, &in)) != sync_error::ok ) {
+        return ec;
+    }
+    std::uint64_t rcount{};
+    std::string rdigest;
+    block_decoder tip_parser{in};
+    if ( !tip_parser.pod(&rcount) || !tip_parser.str(&rdigest) ) {
+        return sync_error::protocol;
+    }
+
+    // the number of leading blocks both sides have in common.
+    // equal chain digests at some idx mean equal chains below it, so the predicate is monotonic.
+    const std::uint64_t lcount = st.blocks();
+    std::uint64_t common{};
+    if ( lcount && rcount && lcount >= rcount && detail::chain_digest(st, rcount-1) == rdigest ) {
+        common = rcount;
+    } else {
+        std::uint64_t lo = 0, hi = std::min(lcount, rcount);
+        // the usual case: the local side is behind, a single request is enough
+        if ( hi && lcount <= rcount ) {
+            std::string h;
+            if ( (ec = detail::remote_digest(ch, hi-1, &h)) != sync_error::ok ) {
+                return ec;
+            }
+            if ( h == detail::chain_digest(st, hi-1) ) {
+                lo = hi;
+            } else {
+                --hi;
+            }
+        }
+        while ( lo < hi ) {
+            std::uint64_t mid = lo + (hi - lo) / 2;
+            std::string h;
+            if ( (ec = detail::remote_digest(ch, mid, &h)) != sync_error::ok ) {
+                return ec;
+            }
+            if ( h == detail::chain_digest(st, mid) ) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        common = lo;
+    }
+
+    // different roots can't be merged
+    if ( common == 0 && lcount && rcount ) {
+        ch.send(sync_msg::done, std::string());
+
+        return sync_error::rejected;
+    }
+
+    // the blocks extending the local tip are appended a batch at a time with a single write.
+    // the others, a side branch until it becomes the longest, are added one by one under
+    // the block before them by its offset, not by its previous hash, which is the digest
+    // of a payload that can be there on both branches
+    std::string prev = common ? detail::local_hash(st, common-1) : std::string();
+    std::uint64_t parent = common ? st.offset_of(common-1) : 0;
+    std::vector<block> run;
+    for ( std::uint64_t next = common; next < rcount; ) {
+        out.clear();
+        detail::put_u64(out, next);
+        detail::put_u32(out, std::min<std::uint64_t>(rcount - next, sync_batch_blocks));
+        if ( (ec = detail::request(ch, sync_msg::blocks, out, &in)) != sync_error::ok ) {
+            return ec;
+        }
+
+        block_decoder parser{in};
+        std::uint32_t n{};
+        if ( !parser.pod(&n) || n == 0 ) {
+            return sync_error::protocol;
+        }
+
+        block b;
+        run.clear();
+        for ( std::uint32_t i = 0; i < n; ++i, ++next ) {
+            if ( parser.blk(&b) != decode_error::ok ) {
+                return sync_error::protocol;
+            }
+            // a pruned block from the other side is taken by its linkage only
+            if ( !b.pruned && b.sha256 != sha256_hex(b.data) ) {
+                return sync_error::bad_hash;
+            }
+            if ( b.idx != next ) {
+                return sync_error::bad_idx;
+            }
+            if ( b.prevsha256 != prev ) {
+                return sync_error::bad_prev_hash;
+            }
+
+            prev = b.sha256;
+            if ( !run.empty() || st.empty() || parent == st.tip().offset ) {
+                run.push_back(std::move(b));
+                continue;
+            }
+
+            const storage::add_error aec = st.add(b, parent, &parent);
+            if ( aec != storage::add_error::ok && aec != storage::add_error::duplicate ) {
+                return sync_error::rejected;
+            }
+            if ( received && aec == storage::add_error::ok ) {
+                ++(*received);
+            }
+        }
+        if ( !parser.at_end() ) {
+            return sync_error::protocol;
+        }
+
+        if ( !run.empty() ) {
+            if ( st.add(run) != storage::add_error::ok ) {
+                return sync_error::rejected;
+            }
+            if ( received ) {
+                *received += run.size();
+            }
+            parent = st.tip().offset;
+        }
+    }
+
+    ch.send(sync_msg::done, std::string());
+
+    return sync_error::ok;
+}
+
+// in-process transport: 'src' is served from a thread over a socketpair.
+inline
+sync_error sync_local(storage &dst, storage &src, std::uint64_t *received = nullptr) {
+    int fds[2];
+    if ( ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0 ) {
+        return sync_error::io;
+    }
+
+    const int sfd = fds[1];
+    std::thread server([&src, sfd] { sync_serve(src, sfd); });
+    sync_error ec = sync_pull(dst, fds[0], received);
+    ::shutdown(fds[0], SHUT_RDWR);
+    server.join();
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+
+    return ec;
+}
+
+/*************************************************************************************************/
+
+#endif // __blockchain__sync_hpp
@@ -0,0 +1,102 @@
+
+#ifndef __blockchain__tip_hpp
+#define __blockchain__tip_hpp
+
+#include "sidefile.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+
+/*************************************************************************************************/
+
+// the canonical tip of a chain file.
+struct chain_tip {
+    std::uint64_t offset;
+    std::uint64_t idx;
+    std::string sha256;
+};
+
+// the last known canonical tip, so opening the storage reads neither the data file nor the index.
+// the record is rewritten in place by a single write after every append. 'stamp' is the data file
+// it was written for (see data_stamp), a record not matching the data file or failing
+// its checksum (a torn write) is stale.
+struct tip_cache {
+    enum: std::size_t { hash_size = 64 };
+
+    struct record {
+        data_stamp stamp;
+        std::uint64_t offset;
+        std::uint64_t idx;
+        char sha256[hash_size];
+        std::uint64_t check;
+    };
+
+    explicit tip_cache(const std::string &fname, bool read_only = false)
+        :m_file{fname, "tip", read_only}
+    {}
+
+    void reopen() {
+        m_file.reopen();
+    }
+
+    // false when the record is missing, torn, or written for other contents of the data file.
+    bool load(const data_stamp &stamp, chain_tip *tip) const {
+        record rec{};
+
+        return read(&rec, tip) && rec.stamp == stamp;
+    }
+    // the record whatever size of the data file it was written for, for following
+    // the appends of another process. false when the record is missing or torn.
+    bool latest(std::uint64_t *covered, chain_tip *tip) const {
+        record rec{};
+        if ( !read(&rec, tip) ) {
+            return false;
+        }
+        *covered = rec.stamp.covered;
+
+        return true;
+    }
+
+    void store(const data_stamp &stamp, const chain_tip &tip) {
+        record rec{};
+        rec.stamp = stamp;
+        rec.offset = tip.offset;
+        rec.idx = tip.idx;
+        std::memcpy(rec.sha256, tip.sha256.data(), std::min<std::size_t>(tip.sha256.size(), hash_size));
+        rec.check = checksum(rec);
+
+        m_file.write(0, &rec, sizeof(rec));
+    }
+
+private:
+    bool read(record *rec, chain_tip *tip) const {
+        if ( !m_file.try_read(0, rec, sizeof(*rec))
+            || rec->check != checksum(*rec)
+            || rec->offset >= rec->stamp.covered )
+        {
+            return false;
+        }
+
+        tip->offset = rec->offset;
+        tip->idx = rec->idx;
+        tip->sha256.assign(rec->sha256, hash_size);
+
+        return true;
+    }
+
+    // over everything but the checksum itself
+    static std::uint64_t checksum(const record &rec) {
+        return fnv1a(&rec, offsetof(record, check));
+    }
+
+private:
+    side_file m_file;
+};
+
+/*************************************************************************************************/
+
+#endif // __blockchain__tip_hpp